@@ -15,6 +15,23 @@ static struct tcpha_fe_server server;
 static struct herder_list herders;
 static struct workqueue_struct *processor;
 
+/* Module parameters */
+static int per_cpu_accept = 0;
+module_param(per_cpu_accept, int, 0444);
+MODULE_PARM_DESC(per_cpu_accept, "Run an acceptor on every herder cpu (default 0)");
+static int defer_accept = 0;
+module_param(defer_accept, int, 0444);
+MODULE_PARM_DESC(defer_accept, "Seconds to hold data-less connections in accept, 0 is off (default 0)");
+static int max_clients = 0;
+module_param(max_clients, int, 0444);
+MODULE_PARM_DESC(max_clients, "Connections allowed at once, 0 is TCPHA_MAX_CONNECTIONS (default 0)");
+static int max_herder_clients = 0;
+module_param(max_herder_clients, int, 0444);
+MODULE_PARM_DESC(max_herder_clients, "Connections allowed on one herder, 0 is no limit (default 0)");
+static int shed_mode = TCPHA_SHED_RST;
+module_param(shed_mode, int, 0444);
+MODULE_PARM_DESC(shed_mode, "Refuse over budget connections with 0 a reset, 1 a 503 (default 0)");
+
 /* Module initilization and setup methods */
 /*---------------------------------------------------------------------------*/
 static int tcpha_init(void) {
@@ -28,6 +45,11 @@ static int tcpha_init(void) {
 
 	/* Startup the acceptor thread */
 	server.conf.port = 8080;
+	server.conf.per_cpu_accept = per_cpu_accept;
+	server.conf.defer_accept = defer_accept;
+	server.conf.max_clients = max_clients;
+	server.conf.max_herder_clients = max_herder_clients;
+	server.conf.shed_mode = shed_mode;
 	server.herders = &herders;
 	server_task = kthread_run(tcpha_fe_server_daemon, &server, "TCPHandoff Server");
 	return 0;
@@ -13,14 +13,101 @@
 #include "tcpha_fe_connection_processor.h"
 #include "tcpha_fe_poll.h"
 #include "tcpha_fe_socket_functions.h"
+#include <linux/net.h>
+#include <linux/cpu.h>
+#include <linux/hash.h>
+#include <linux/proc_fs.h>
+#include <asm/timex.h>
+#include <asm/uaccess.h>
 
 #define MAX_EVENTS 1024
+/* Placement bench picks made per hold of the herder list lock */
+#define TCPHA_BENCH_CHUNK 1024
+/* Where the locality and busy poll stats can be read while running */
+#define TCPHA_STATS_PROC "tcphafe_stats"
+/* Each herders inline budget, "<cpu> <budget>" written to it changes one */
+#define TCPHA_INLINE_PROC "tcphafe_inline"
 
 kmem_cache_t *tcpha_fe_conn_cachep = NULL;
 atomic_t mem_cache_use = ATOMIC_INIT(0);
+atomic_t tcpha_fe_node_hits[MAX_NUMNODES];
+atomic_t tcpha_fe_node_misses[MAX_NUMNODES];
 static int num_pools;
-/* This cache is for allocating work to do work_structs */
-kmem_cache_t *work_struct_cachep = NULL;
+
+/* How new connections are spread over the herders */
+int tcphafe_placement = TCPHA_PLACE_TWO_CHOICES;
+module_param(tcphafe_placement, int, 0644);
+MODULE_PARM_DESC(tcphafe_placement, "Herder placement: 0 two random choices, 1 least loaded, 2 flow affinity (default 0)");
+/* Where the listener records the cpu each connection arrived on, keyed by
+ * its sock. Only a hint, two connections landing in one slot lose one. */
+#define TCPHA_RX_CPU_BITS 10
+static struct {
+    struct sock *sk;
+    int cpu;
+} tcpha_fe_rx_cpus[1 << TCPHA_RX_CPU_BITS];
+static DEFINE_SPINLOCK(tcpha_fe_rx_cpu_lock);
+
+/* Flow affinity gives up on the flows herder past this many connections */
+int tcphafe_affinity_max_pool = 4096;
+module_param(tcphafe_affinity_max_pool, int, 0644);
+MODULE_PARM_DESC(tcphafe_affinity_max_pool, "Pool size at which flow affinity falls back to two random choices (default 4096)");
+/* Picks to time for each placement policy at load, 0 skips it */
+static int tcphafe_placement_bench = 0;
+module_param(tcphafe_placement_bench, int, 0444);
+MODULE_PARM_DESC(tcphafe_placement_bench, "Picks to benchmark each placement policy with at load (default 0)");
+/* Herders start out processing this many connections per pass themselves */
+static int tcphafe_inline_budget = 0;
+module_param(tcphafe_inline_budget, int, 0444);
+MODULE_PARM_DESC(tcphafe_inline_budget, "Connections per pass each herder starts out processing itself, 0 uses the processor, see /proc/tcphafe_inline (default 0)");
+/* A herder with more than this many ready connections gets help, 0 is never */
+int tcphafe_steal_threshold = 64;
+module_param(tcphafe_steal_threshold, int, 0644);
+MODULE_PARM_DESC(tcphafe_steal_threshold, "Ready connections at which idle herders steal from a herder, 0 is off (default 64)");
+/* Most connections taken in one steal */
+int tcphafe_steal_batch = 32;
+module_param(tcphafe_steal_batch, int, 0644);
+MODULE_PARM_DESC(tcphafe_steal_batch, "Most ready connections taken in one steal (default 32, max 1024)");
+
+/* Most connections a herder takes off its ready list per pass */
+int tcphafe_herder_budget = 64;
+module_param(tcphafe_herder_budget, int, 0644);
+MODULE_PARM_DESC(tcphafe_herder_budget, "Most ready connections a herder handles per pass (default 64, max 1024)");
+
+/* Connection timeouts in seconds, 0 turns one off */
+int tcphafe_header_timeout = 10;
+module_param(tcphafe_header_timeout, int, 0644);
+MODULE_PARM_DESC(tcphafe_header_timeout, "Seconds a new connection has to send a full header, 0 is forever (default 10)");
+int tcphafe_idle_timeout = 60;
+module_param(tcphafe_idle_timeout, int, 0644);
+MODULE_PARM_DESC(tcphafe_idle_timeout, "Seconds a connection may go without any events, 0 is forever (default 60)");
+int tcphafe_lifetime = 3600;
+module_param(tcphafe_lifetime, int, 0644);
+MODULE_PARM_DESC(tcphafe_lifetime, "Seconds a connection may live in total, 0 is forever (default 3600)");
+/* Most timed out connections a herder reaps per pass */
+int tcphafe_reap_batch = 64;
+module_param(tcphafe_reap_batch, int, 0644);
+MODULE_PARM_DESC(tcphafe_reap_batch, "Most timed out connections a herder reaps per pass (default 64)");
+
+/* How often the rebalancer looks at the herders, 0 never */
+static int tcphafe_rebalance_ms = 1000;
+module_param(tcphafe_rebalance_ms, int, 0444);
+MODULE_PARM_DESC(tcphafe_rebalance_ms, "Milliseconds between herder rebalancing passes, 0 is off (default 1000)");
+/* How much busier than the quietest herder the busiest must be */
+int tcphafe_rebalance_pct = 50;
+module_param(tcphafe_rebalance_pct, int, 0644);
+MODULE_PARM_DESC(tcphafe_rebalance_pct, "Percent more events than the quietest herder before the busiest is rebalanced (default 50)");
+/* And ignore imbalances below this many events per pass */
+int tcphafe_rebalance_min = 1000;
+module_param(tcphafe_rebalance_min, int, 0644);
+MODULE_PARM_DESC(tcphafe_rebalance_min, "Events per pass the busiest herder needs before it is rebalanced (default 1000)");
+
+/* How connections are polled, see tcpha_fe_conn_epoll_flags */
+static int tcphafe_oneshot = 1;
+module_param(tcphafe_oneshot, int, 0444);
+MODULE_PARM_DESC(tcphafe_oneshot, "Don't report a connection again until it has been processed (default 1)");
+static int tcphafe_edge = 0;
+module_param(tcphafe_edge, int, 0444);
+MODULE_PARM_DESC(tcphafe_edge, "Only report connections when new data arrives, ignoring ACKs (default 0)");
 
 /* Private Functions */
 /*---------------------------------------------------------------------------*/
@@ -28,42 +115,96 @@ static void destroy_connection_herders(struct herder_list *herders);
 
 /* Initilazers etc. */
 /*---------------------------------------------------------------------------*/
-static inline struct work_struct *work_alloc(void);
-static inline void work_free(struct work_struct *work);
-
 static int herder_init(struct tcpha_fe_herder **herder, int cpu);
 static void herder_destroy(struct tcpha_fe_herder *herder);
 
-static inline struct tcpha_fe_herder *herder_alloc(void);
+static inline struct tcpha_fe_herder *herder_alloc(int node);
 static inline void herder_free(struct tcpha_fe_herder *herder);
 
 static inline void herder_list_init(struct herder_list *herders);
+static void herder_list_add(struct herder_list *herders, struct tcpha_fe_herder *herder);
+static void herder_list_remove(struct herder_list *herders, struct tcpha_fe_herder *herder);
+
+/* Starting and stopping herders, at load/unload and on cpu hotplug */
+static int herder_start(struct herder_list *herders, int cpu);
+static void herder_stop(struct herder_list *herders, struct tcpha_fe_herder *herder);
+static int herder_cpu_callback(struct notifier_block *nfb, unsigned long action, void *hcpu);
+static void tcpha_fe_conn_migrate(struct tcpha_fe_conn *conn, struct tcpha_fe_herder *to);
+static void herder_rebalance(void *data);
+static int herder_rebalance_pick(struct tcpha_fe_herder *hot, struct tcpha_fe_conn **conns, unsigned long want);
+
+static struct tcpha_fe_herder *herder_pick(struct herder_list *herders, int cpu, int rx_cpu);
+static struct tcpha_fe_herder *herder_choose(struct herder_list *herders, int rx_cpu);
+static struct tcpha_fe_herder *herder_pick_two_choices(struct herder_list *herders, int rx_cpu);
+static struct tcpha_fe_herder *herder_pick_least_loaded(struct herder_list *herders, int rx_cpu);
+static struct tcpha_fe_herder *herder_pick_flow_affinity(struct herder_list *herders, int rx_cpu);
+static void herder_placement_bench(struct herder_list *herders, int picks);
+
+static struct tcpha_fe_placement placements[TCPHA_PLACE_MAX] = {
+    [TCPHA_PLACE_TWO_CHOICES] = { "two random choices", herder_pick_two_choices },
+    [TCPHA_PLACE_LEAST_LOADED] = { "least loaded", herder_pick_least_loaded },
+    [TCPHA_PLACE_FLOW_AFFINITY] = { "flow affinity", herder_pick_flow_affinity },
+};
+static int herder_add_conns(struct tcpha_fe_herder *herder, struct tcpha_fe_conn *conns[], int nconns);
+static int herder_read_stats(char *page, char **start, off_t off, int count, int *eof, void *data);
+static int herder_read_inline(char *page, char **start, off_t off, int count, int *eof, void *data);
+static int herder_write_inline(struct file *file, const char __user *buffer, unsigned long count, void *data);
+static int herder_proc_done(char *page, char **start, off_t off, int count, int *eof, int len);
+
+static struct tcpha_fe_conn *tcpha_fe_conn_alloc(struct socket *sock, int node);
+
+static void herder_dispatch(struct tcpha_fe_herder *herder, struct tcpha_fe_conn **conns, int numevents);
+static int herder_steal(struct tcpha_fe_herder *herder, struct tcpha_fe_conn **conns, int maxevents);
+static void herder_call_for_help(struct tcpha_fe_herder *herder);
+
+/* Connection aging */
+static unsigned long tcpha_fe_conn_deadline(struct tcpha_fe_conn *conn);
+static unsigned long herder_conn_expired(struct tcpha_fe_timer *timer, void *data);
+static int herder_reap(struct tcpha_fe_herder *herder, struct tcpha_fe_conn **conns, int maxevents);
 
 /* Function implementations */
 /*---------------------------------------------------------------------------*/
 
 /* Constructors and allocaters */
-static inline struct tcpha_fe_herder *herder_alloc() {
-    return kmalloc(sizeof(struct tcpha_fe_herder), GFP_KERNEL);
+static inline struct tcpha_fe_herder *herder_alloc(int node) {
+    return kmalloc_node(sizeof(struct tcpha_fe_herder), GFP_KERNEL, node);
 }
 
 int herder_init(struct tcpha_fe_herder **herder, int cpu)
 {
     int err;
     struct tcpha_fe_herder *h;
-    h = herder_alloc();
+    int node = cpu_to_node(cpu);
+
+    /* Everything the herder owns lives next to the cpu it runs on */
+    h = herder_alloc(node);
+    if (!h)
+        return -ENOMEM;
+    tcpha_fe_count_node_alloc(h, node);
 
     /* Create our epoller */
-    err = tcp_epoll_init(&h->eventpoll);
+    err = tcp_epoll_init(&h->eventpoll, node);
     if (err < 0)
         goto epoll_create_err;
 
     /* Create everything else */
     h->cpu = cpu; /* What cpu this herder will be working on */
+    h->node = node;
+    h->eventpoll->cpu = cpu;
     INIT_LIST_HEAD(&h->conn_pool);
     INIT_LIST_HEAD(&h->herder_list);
     atomic_set(&h->pool_size, 0);
     rwlock_init(&h->pool_lock);
+    h->inline_budget = tcphafe_inline_budget;
+    h->stat_inline = 0;
+    h->stat_queued = 0;
+    h->stat_steals = 0;
+    h->stat_stolen = 0;
+    h->events = 0;
+    h->events_sampled = 0;
+    h->stat_moved_in = 0;
+    h->stat_moved_out = 0;
+    tcpha_fe_wheel_init(&h->wheel);
     *herder = h;
     return 0;
 
@@ -81,21 +222,62 @@ static inline void herder_free(struct tcpha_fe_herder *herder)
 void herder_destroy(struct tcpha_fe_herder *herder)
 {
     struct tcpha_fe_conn *conn, *next;
+    LIST_HEAD(dying);
+
+    /* Let anything already queued for our connections finish (a herder
+     * stopped for hotplug has handed all of its connections on) */
+    if (!list_empty(&herder->conn_pool))
+        flush_workqueue(herder->processor_work);
 
-    /* Cleanup connection pool */
+    /* Cleanup connection pool, destroying takes the pool lock
+     * itself so pull everyone off the pool first */
     write_lock(&herder->pool_lock);
+    list_splice_init(&herder->conn_pool, &dying);
+    write_unlock(&herder->pool_lock);
+
     printk(KERN_ALERT "Cleaning up connections\n");
-    list_for_each_entry_safe(conn, next, &herder->conn_pool, list) {
+    list_for_each_entry_safe(conn, next, &dying, list) {
         tcpha_fe_conn_destroy(herder, conn);
         printk(KERN_ALERT "   Connection destroyed on Pool: %u\n", herder->cpu);
     }
     printk(KERN_ALERT "Freeing Pool ... ");
-    list_del(&herder->conn_pool);
-    write_unlock(&herder->pool_lock);
+    tcpha_fe_wheel_destroy(&herder->wheel);
+
+    printk(KERN_ALERT "Herder %u: %d wakeups, %d from other cpus, %d ignored, %d polled, %d push retries\n",
+           herder->cpu,
+           atomic_read(&herder->eventpoll->stat_wakeups),
+           atomic_read(&herder->eventpoll->stat_remote_wakeups),
+           atomic_read(&herder->eventpoll->stat_wakeups_ignored),
+           atomic_read(&herder->eventpoll->stat_polls),
+           atomic_read(&herder->eventpoll->stat_push_retries));
+    printk(KERN_ALERT "Herder %u: woken %d times for %d wakeups\n",
+           herder->cpu,
+           atomic_read(&herder->eventpoll->stat_poller_wakeups),
+           atomic_read(&herder->eventpoll->stat_wakeups));
+    printk(KERN_ALERT "Herder %u: %d epoll items freed in %d batches\n",
+           herder->cpu,
+           atomic_read(&herder->eventpoll->stat_freed),
+           atomic_read(&herder->eventpoll->stat_free_batches));
+    printk(KERN_ALERT "Herder %u: %lu processed inline, %lu queued\n",
+           herder->cpu, herder->stat_inline, herder->stat_queued);
+    printk(KERN_ALERT "Herder %u: %lu steals taking %lu connections\n",
+           herder->cpu, herder->stat_steals, herder->stat_stolen);
+    printk(KERN_ALERT "Herder %u: %lu busy polls found work, %lu slept (budget %dus)\n",
+           herder->cpu, herder->eventpoll->stat_spin_hits,
+           herder->eventpoll->stat_spin_misses, herder->eventpoll->busy_poll_us);
+    printk(KERN_ALERT "Herder %u: ready delay max %lu jiffies, histogram"
+           " <1:%lu <2:%lu <4:%lu <8:%lu <16:%lu <32:%lu <64:%lu more:%lu\n",
+           herder->cpu, herder->eventpoll->stat_max_delay,
+           herder->eventpoll->stat_delay[0], herder->eventpoll->stat_delay[1],
+           herder->eventpoll->stat_delay[2], herder->eventpoll->stat_delay[3],
+           herder->eventpoll->stat_delay[4], herder->eventpoll->stat_delay[5],
+           herder->eventpoll->stat_delay[6], herder->eventpoll->stat_delay[7]);
+    printk(KERN_ALERT "Herder %u: %lu connections timed out, %lu timers re-armed\n",
+           herder->cpu, herder->wheel.stat_expired, herder->wheel.stat_rearmed);
+    printk(KERN_ALERT "Herder %u: %lu connections rebalanced in, %lu out\n",
+           herder->cpu, herder->stat_moved_in, herder->stat_moved_out);
 
     /* Cleanup epoll */
-    printk(KERN_ALERT "Deleting From Herder List ... ");
-    list_del(&herder->herder_list);
     printk(KERN_ALERT "Freeing From Epoll ... ");
     tcp_epoll_destroy(herder->eventpoll);
     printk(KERN_ALERT "Freeing Herder ... ");
@@ -104,20 +286,167 @@ void herder_destroy(struct tcpha_fe_herder *herder)
     printk(KERN_ALERT "Herder cleaned up\n");
 }
 
-static inline struct work_struct *work_alloc() 
+static inline void herder_list_init(struct herder_list *herders)
+{
+    INIT_LIST_HEAD(&herders->list);
+    rwlock_init(&herders->lock);
+    memset(herders->by_cpu, 0, sizeof(herders->by_cpu));
+    memset(herders->array, 0, sizeof(herders->array));
+    herders->count = 0;
+    herders->processors = NULL;
+    INIT_WORK(&herders->rebalance_work, herder_rebalance, herders);
+    mutex_init(&herders->rebalance_lock);
+    herders->rebalancing = 0;
+    atomic_set(&herders->nconns, 0);
+    herders->max_conns = MAX_INT;
+    herders->max_per_herder = 0;
+}
+/* Must be called with the herder list write locked */
+static void herder_list_add(struct herder_list *herders, struct tcpha_fe_herder *herder)
 {
-    return kmem_cache_alloc(work_struct_cachep, GFP_KERNEL);
+    list_add(&herder->herder_list, &herders->list);
+    herders->by_cpu[herder->cpu] = herder;
+    herders->array[herders->count++] = herder;
 }
-static inline void work_free(struct work_struct *work)
+
+/* Must be called with the herder list write locked */
+static void herder_list_remove(struct herder_list *herders, struct tcpha_fe_herder *herder)
 {
-    kmem_cache_free(work_struct_cachep, work);
+    int i;
+
+    list_del_init(&herder->herder_list);
+    herders->by_cpu[herder->cpu] = NULL;
+    for (i = 0; i < herders->count; i++) {
+        if (herders->array[i] == herder) {
+            herders->array[i] = herders->array[--herders->count];
+            herders->array[herders->count] = NULL;
+            break;
+        }
+    }
 }
 
-static inline void herder_list_init(struct herder_list *herders)
+/*
+ * Create a herder for a cpu, put it on the list and set it running.
+ */
+static int herder_start(struct herder_list *herders, int cpu)
 {
-    INIT_LIST_HEAD(&herders->list);
-    rwlock_init(&herders->lock);
+    struct tcpha_fe_herder *herder;
+    int err;
+
+    err = herder_init(&herder, cpu);
+    if (err)
+        return err;
+    herder->processor_work = herders->processors;
+    herder->herders = herders;
+
+    /* Initialize our work, passing ourself as the data object
+     * (basically the this pointer lol) */
+    herder->task = kthread_create(tcpha_fe_herder_run, herder, "TCPHA Herder %u", cpu);
+    if (IS_ERR(herder->task)) {
+        printk(KERN_ALERT "Error Making Herder Process");
+        err = PTR_ERR(herder->task);
+        herder_destroy(herder);
+        return err;
+    }
+    kthread_bind(herder->task, cpu);
+
+    write_lock(&herders->lock);
+    herder_list_add(herders, herder);
+    write_unlock(&herders->lock);
+
+    printk(KERN_ALERT "Adding Herder for CPU: %u\n", cpu);
+    wake_up_process(herder->task);
+    return 0;
 }
+
+/*
+ * Take a herder off the list and stop it. Any connections it still has
+ * are moved to the remaining herders (if there are any), then it is freed.
+ */
+static void herder_stop(struct herder_list *herders, struct tcpha_fe_herder *herder)
+{
+    struct tcpha_fe_herder *to;
+    struct tcpha_fe_conn *conn;
+    int err;
+
+    /* Keep the rebalancer from moving things while we do */
+    mutex_lock(&herders->rebalance_lock);
+
+    /* No new connections or thieves from here on */
+    write_lock(&herders->lock);
+    herder_list_remove(herders, herder);
+    write_unlock(&herders->lock);
+
+    printk(KERN_ALERT "   Stoping Herder %u ... ", herder->cpu);
+    /* kthread_stop wakes the poller, tcp_epoll_wait won't sleep again */
+    err = kthread_stop(herder->task);
+    if (err)
+        printk(KERN_ALERT "Error Killing Proc\n");
+
+    /* Hand our connections to the survivors one at a time, migrating
+     * can sleep so we can't hold the pool lock across it */
+    for (;;) {
+        write_lock(&herder->pool_lock);
+        if (list_empty(&herder->conn_pool)) {
+            write_unlock(&herder->pool_lock);
+            break;
+        }
+        conn = list_entry(herder->conn_pool.next, struct tcpha_fe_conn, list);
+        tcpha_fe_conn_get(conn);
+        write_unlock(&herder->pool_lock);
+
+        read_lock(&herders->lock);
+        to = herder_choose(herders, -1);
+        read_unlock(&herders->lock);
+        if (!to) {
+            tcpha_fe_conn_put(conn);
+            break;
+        }
+
+        tcpha_fe_conn_migrate(conn, to);
+        tcpha_fe_conn_put(conn);
+        cond_resched();
+    }
+    mutex_unlock(&herders->rebalance_lock);
+
+    /* We need to remove the epoll stuff before killing the connection
+     * other wise we will end up with bad memory access on the socket */
+    printk(KERN_ALERT "Destroying Herder %u\n", herder->cpu);
+    herder_destroy(herder);
+}
+
+/*
+ * Follow the cpus we are given: a herder for every cpu that comes online,
+ * and a cpu going offline hands its connections to the others first. If
+ * the offline is then called off, the cpu gets a fresh herder.
+ */
+static int herder_cpu_callback(struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    struct herder_list *herders = container_of(nfb, struct herder_list, cpu_notifier);
+    struct tcpha_fe_herder *herder;
+    int cpu = (long)hcpu;
+
+    switch (action) {
+    case CPU_ONLINE:
+    case CPU_DOWN_FAILED:
+        if (herders->by_cpu[cpu])
+            break;
+        if (herder_start(herders, cpu))
+            printk(KERN_ALERT "Error starting Herder for CPU: %u\n", cpu);
+        break;
+    case CPU_DOWN_PREPARE:
+        herder = herders->by_cpu[cpu];
+        if (!herder)
+            break;
+        /* Someone has to be left to take the connections */
+        if (herders->count < 2)
+            return NOTIFY_BAD;
+        herder_stop(herders, herder);
+        break;
+    }
+    return NOTIFY_OK;
+}
+
 /* Externaly Available Functions */
 /*---------------------------------------------------------------------------*/
 /*
@@ -125,9 +454,9 @@ static inline void herder_list_init(struct herder_list *herders)
  */
 int init_connections(struct herder_list *herders, struct workqueue_struct *processors)
 {
+    struct proc_dir_entry *entry;
     int cpu;
     int err;
-    struct tcpha_fe_herder *herder;
 
     atomic_inc(&mem_cache_use);
     /* Create our memory caches if they don't already exist */
@@ -138,55 +467,56 @@ int init_connections(struct herder_list *herders, struct workqueue_struct *proce
     if (!tcpha_fe_conn_cachep)
         return -ENOMEM;
 
-    if (work_struct_cachep == NULL)
-        work_struct_cachep = kmem_cache_create("tcpha_work_struct_cache", 
-                                               sizeof(struct work_struct), 
-                                               0,
-                                               SLAB_HWCACHE_ALIGN,
-                                               NULL, NULL);
-
-    if (!work_struct_cachep)
-        goto errorWorkAlloc;
-
     herder_list_init(herders);
-    write_lock(&herders->lock);
+    herders->processors = processors;
     /* Create our connection pools to work from */
     /* One connection pool per processor */
     num_pools = 0;
+    lock_cpu_hotplug();
     for_each_online_cpu(cpu) {
-        err = herder_init(&herder, cpu);
-        if (err)
+        err = herder_start(herders, cpu);
+        if (err) {
+            unlock_cpu_hotplug();
             goto errorHerderAlloc;
-        herder->processor_work = processors;
-
-        list_add(&herder->herder_list, &herders->list);
-        printk(KERN_ALERT "Adding Herder for CPU: %u\n", cpu);
-        /* Initialize our work, passing ourself as the data object
-        * (basically the this pointer lol) */
-        herder->task = kthread_create(tcpha_fe_herder_run, herder, "TCPHA Herder %u", cpu);
-        kthread_bind(herder->task, cpu);
-        if (!IS_ERR(herder->task)) {
-            wake_up_process(herder->task);
-        } else {
-            goto errHerderProc;
         }
     }
-    write_unlock(&herders->lock);
+
+    /* And keep following the cpus from now on */
+    herders->cpu_notifier.notifier_call = herder_cpu_callback;
+    herders->cpu_notifier.priority = 0;
+    register_cpu_notifier(&herders->cpu_notifier);
+    unlock_cpu_hotplug();
+
+    if (tcphafe_rebalance_ms > 0) {
+        herders->rebalancing = 1;
+        queue_delayed_work(processors, &herders->rebalance_work,
+                           msecs_to_jiffies(tcphafe_rebalance_ms));
+    }
+
+    if (tcphafe_placement_bench > 0)
+        herder_placement_bench(herders, tcphafe_placement_bench);
+
+    /* Not having the stats isn't worth failing the load over */
+    if (!create_proc_read_entry(TCPHA_STATS_PROC, 0444, NULL, herder_read_stats, herders))
+        printk(KERN_ALERT "Couldn't create /proc/%s\n", TCPHA_STATS_PROC);
+    entry = create_proc_entry(TCPHA_INLINE_PROC, 0644, NULL);
+    if (entry) {
+        entry->read_proc = herder_read_inline;
+        entry->write_proc = herder_write_inline;
+        entry->data = herders;
+    } else {
+        printk(KERN_ALERT "Couldn't create /proc/%s\n", TCPHA_INLINE_PROC);
+    }
 
     return 0;
 
-    errHerderProc:
-    printk(KERN_ALERT "Error Making Herder Process");
     errorHerderAlloc:
     destroy_connection_herders(herders);
-    kmem_cache_destroy(work_struct_cachep);
-    errorWorkAlloc:
     kmem_cache_destroy(tcpha_fe_conn_cachep);
     atomic_dec(&mem_cache_use);
     return -ENOMEM;
 }
 
-/* TODO: This code needs error handling */
 /* TODO: We should probably get the socket here! */
 /*
  * Add a socket connection to the herders to be processed.
@@ -194,25 +524,194 @@ int init_connections(struct herder_list *herders, struct workqueue_struct *proce
  * @sock : The socket to add
  */
 int tcpha_fe_conn_create(struct herder_list *herders, struct socket *sock)
+{
+    return tcpha_fe_conn_create_batch(herders, &sock, 1, -1) == 1 ? 0 : -ENOMEM;
+}
+
+/*
+ * Add a socket connection to the herder running on a cpu.
+ * @herders : The list of herders to chose from
+ * @sock : The socket to add
+ * @cpu : The cpu the connection was accepted on
+ */
+int tcpha_fe_conn_create_local(struct herder_list *herders, struct socket *sock, int cpu)
+{
+    return tcpha_fe_conn_create_batch(herders, &sock, 1, cpu) == 1 ? 0 : -ENOMEM;
+}
+
+/* Called in softirq by the listener */
+void tcpha_fe_set_rx_cpu(struct sock *sk, int cpu)
+{
+    int slot = hash_ptr(sk, TCPHA_RX_CPU_BITS);
+
+    spin_lock(&tcpha_fe_rx_cpu_lock);
+    tcpha_fe_rx_cpus[slot].sk = sk;
+    tcpha_fe_rx_cpus[slot].cpu = cpu;
+    spin_unlock(&tcpha_fe_rx_cpu_lock);
+}
+
+int tcpha_fe_take_rx_cpu(struct sock *sk)
+{
+    int slot = hash_ptr(sk, TCPHA_RX_CPU_BITS);
+    int cpu = -1;
+
+    spin_lock_bh(&tcpha_fe_rx_cpu_lock);
+    if (tcpha_fe_rx_cpus[slot].sk == sk) {
+        cpu = tcpha_fe_rx_cpus[slot].cpu;
+        tcpha_fe_rx_cpus[slot].sk = NULL;
+    }
+    spin_unlock_bh(&tcpha_fe_rx_cpu_lock);
+    return cpu;
+}
+
+/*
+ * Add a batch of socket connections to the herders to be processed.
+ * @herders : The list of herders to chose from
+ * @socks : The sockets to add, taken sockets are set to NULL
+ * @nsocks : How many sockets there are
+ * @cpu : The cpu the connections should stay on, or -1 for any. Only
+ *        connections that arrived on it (or that we don't know the
+ *        arrival cpu of) stay, the rest go to the cpu they arrived on.
+ */
+int tcpha_fe_conn_create_batch(struct herder_list *herders, struct socket *socks[], int nsocks, int cpu)
+{
+    struct tcpha_fe_herder *targets[TCPHA_CONN_BATCH];
+    struct tcpha_fe_conn *conns[TCPHA_CONN_BATCH];
+    struct tcpha_fe_herder *herder;
+    int rx_cpus[TCPHA_CONN_BATCH];
+    int i, j, n;
+    int created = 0;
+
+    if (nsocks > TCPHA_CONN_BATCH)
+        nsocks = TCPHA_CONN_BATCH;
+
+    for (i = 0; i < nsocks; i++)
+        rx_cpus[i] = tcpha_fe_take_rx_cpu(socks[i]->sk);
+
+    /* Pick a herder for everyone in one go */
+    read_lock(&herders->lock);
+    for (i = 0; i < nsocks; i++)
+        targets[i] = herder_pick(herders,
+                                 (cpu < 0 || rx_cpus[i] < 0) ? cpu : rx_cpus[i],
+                                 rx_cpus[i]);
+    read_unlock(&herders->lock);
+
+    for (i = 0; i < nsocks; i++) {
+        herder = targets[i];
+        if (!herder)
+            continue;
+
+        /* Gather up this herders share of the batch */
+        n = 0;
+        for (j = i; j < nsocks; j++) {
+            if (targets[j] != herder)
+                continue;
+            targets[j] = NULL;
+
+            conns[n] = tcpha_fe_conn_alloc(socks[j], herder->node);
+            if (!conns[n]) {
+                /* Give back the slots herder_pick reserved */
+                atomic_dec(&herder->pool_size);
+                atomic_dec(&herders->nconns);
+                continue;
+            }
+            socks[j] = NULL;
+            n++;
+        }
+
+        created += herder_add_conns(herder, conns, n);
+    }
+
+    return created;
+}
+
+/*
+ * Choose the herder a new connection goes to and reserve a slot in it and
+ * in the overall budget. Must be called with the herder list read locked.
+ * Returns NULL if the connection should be refused.
+ * @cpu : The cpu the connection must stay on, or -1 for any
+ * @rx_cpu : The cpu the flow is coming in on, or -1 if unknown
+ */
+static struct tcpha_fe_herder *herder_pick(struct herder_list *herders, int cpu, int rx_cpu)
+{
+    struct tcpha_fe_herder *herder;
+
+    /* Reserve first so racing acceptors can't both take the last slot */
+    if (atomic_inc_return(&herders->nconns) > herders->max_conns)
+        goto over_budget;
+
+    if (cpu >= 0 && herders->by_cpu[cpu])
+        herder = herders->by_cpu[cpu];
+    else
+        herder = herder_choose(herders, rx_cpu);
+    if (!herder)
+        goto over_budget;
+
+    /* Count the connection now so the rest of a batch
+     * sees this herder as a little more loaded */
+    if (atomic_inc_return(&herder->pool_size) > herders->max_per_herder &&
+        herders->max_per_herder) {
+        atomic_dec(&herder->pool_size);
+        goto over_budget;
+    }
+    return herder;
+
+    over_budget:
+    atomic_dec(&herders->nconns);
+    return NULL;
+}
+
+/*
+ * Ask the current placement policy for a herder, without reserving
+ * anything. Must be called with the herder list read locked.
+ */
+static struct tcpha_fe_herder *herder_choose(struct herder_list *herders, int rx_cpu)
+{
+    int policy = tcphafe_placement;
+
+    if (policy < 0 || policy >= TCPHA_PLACE_MAX)
+        policy = TCPHA_PLACE_TWO_CHOICES;
+    return placements[policy].pick(herders, rx_cpu);
+}
+
+void tcpha_fe_conn_set_budget(struct herder_list *herders, int max_conns, int max_per_herder)
+{
+    write_lock(&herders->lock);
+    herders->max_conns = max_conns;
+    herders->max_per_herder = max_per_herder;
+    write_unlock(&herders->lock);
+}
+
+/* Placement policies */
+/*---------------------------------------------------------------------------*/
+/*
+ * Look at two herders at random and take the less loaded one. Nearly as
+ * even as a full scan but only touches two pool counts.
+ */
+static struct tcpha_fe_herder *herder_pick_two_choices(struct herder_list *herders, int rx_cpu)
+{
+    struct tcpha_fe_herder *first, *second;
+
+    if (!herders->count)
+        return NULL;
+
+    first = herders->array[net_random() % herders->count];
+    second = herders->array[net_random() % herders->count];
+    return atomic_read(&first->pool_size) <= atomic_read(&second->pool_size) ?
+        first : second;
+}
+
+/*
+ * Scan every herder for the smallest pool.
+ */
+static struct tcpha_fe_herder *herder_pick_least_loaded(struct herder_list *herders, int rx_cpu)
 {
     struct tcpha_fe_herder *herder;
     int min_pool_size = MAX_INT;
     int herder_pool_size = 0;
     struct tcpha_fe_herder *least_loaded = NULL;
-    /* Setup connection */
-    struct tcpha_fe_conn *connection = kmem_cache_alloc(tcpha_fe_conn_cachep,
-                                                        GFP_KERNEL);
-    struct inet_sock *isk = inet_sk(sock->sk);
-
-    /* TODO: This should be moved to an alloc init method... */
-    connection->csock = sock;
-    INIT_LIST_HEAD(&connection->list);
-    connection->request.hdr = NULL;
-    atomic_set(&connection->alive, 2);
-    rwlock_init(&connection->lock);
 
     /* search for least loaded pool */
-    read_lock(&herders->lock);
     list_for_each_entry(herder, &herders->list, herder_list) {
         /* We are not THAT concered if we end up sending to a
          * slightly more loaded pool, so no need to lock the pool
@@ -223,70 +722,327 @@ int tcpha_fe_conn_create(struct herder_list *herders, struct socket *sock)
             least_loaded = herder;
         }
     }
-    read_unlock(&herders->lock);
+    return least_loaded;
+}
+
+/*
+ * Keep the herder on the cpu the flows softirqs run on, so its wakeups
+ * don't have to cross cpus, unless it is overloaded.
+ */
+static struct tcpha_fe_herder *herder_pick_flow_affinity(struct herder_list *herders, int rx_cpu)
+{
+    struct tcpha_fe_herder *herder = rx_cpu >= 0 ? herders->by_cpu[rx_cpu] : NULL;
+
+    if (herder && atomic_read(&herder->pool_size) < tcphafe_affinity_max_pool)
+        return herder;
+    return herder_pick_two_choices(herders, rx_cpu);
+}
+
+/*
+ * Time each placement policy and see how evenly it spreads connections.
+ * Only safe before any connection exists, as it scribbles on pool_size.
+ * The picks are made TCPHA_BENCH_CHUNK at a time under the herder list
+ * lock, letting go of it and the cpu in between.
+ */
+static void herder_placement_bench(struct herder_list *herders, int picks)
+{
+    struct tcpha_fe_herder *herder;
+    cycles_t start, cycles;
+    int policy, i, done, chunk, rx_cpu;
+    int lo, hi;
+
+    for (policy = 0; policy < TCPHA_PLACE_MAX; policy++) {
+        cycles = 0;
+        for (done = 0; done < picks; done += chunk) {
+            chunk = min(picks - done, TCPHA_BENCH_CHUNK);
+            read_lock(&herders->lock);
+            if (!herders->count) {
+                read_unlock(&herders->lock);
+                return;
+            }
+            start = get_cycles();
+            for (i = 0; i < chunk; i++) {
+                /* Pretend the flows are spread over the cpus by the nic */
+                rx_cpu = herders->array[net_random() % herders->count]->cpu;
+                herder = placements[policy].pick(herders, rx_cpu);
+                atomic_inc(&herder->pool_size);
+            }
+            cycles += get_cycles() - start;
+            read_unlock(&herders->lock);
+            cond_resched();
+        }
+
+        lo = MAX_INT;
+        hi = 0;
+        read_lock(&herders->lock);
+        for (i = 0; i < herders->count; i++) {
+            herder = herders->array[i];
+            lo = min(lo, atomic_read(&herder->pool_size));
+            hi = max(hi, atomic_read(&herder->pool_size));
+            atomic_set(&herder->pool_size, 0);
+        }
+        read_unlock(&herders->lock);
+
+        printk(KERN_ALERT "Placement %s: %lu cycles per pick, pools %d to %d\n",
+               placements[policy].name,
+               (unsigned long)cycles / picks, lo, hi);
+    }
+}
+
+static struct tcpha_fe_conn *tcpha_fe_conn_alloc(struct socket *sock, int node)
+{
+    /* Setup connection, on the node of the herder that will own it */
+    struct tcpha_fe_conn *connection = kmem_cache_alloc_node(tcpha_fe_conn_cachep,
+                                                             GFP_KERNEL, node);
+    if (!connection)
+        return NULL;
+    tcpha_fe_count_node_alloc(connection, node);
+
+    connection->csock = sock;
+    INIT_LIST_HEAD(&connection->list);
+    connection->request.hdr = NULL;
+    atomic_set(&connection->alive, 2);
+    rwlock_init(&connection->lock);
+    connection->herder = NULL;
+    connection->flags = 0;
+    /* This one belongs to the pool */
+    atomic_set(&connection->refcnt, 1);
+    atomic_set(&connection->pending_events, 0);
+    INIT_WORK(&connection->work, process_connection, connection);
+    tcpha_fe_timer_init(&connection->timer);
+    connection->created = jiffies;
+    connection->last_active = connection->created;
+    connection->nevents = 0;
+    connection->nevents_seen = 0;
+    connection->ep_item = NULL;
+    connection->eventpoll = NULL;
+    return connection;
+}
+
+/*
+ * Put connections into a herders pool and epoll. Their pool slots must
+ * already have been reserved by herder_pick.
+ */
+static int herder_add_conns(struct tcpha_fe_herder *herder, struct tcpha_fe_conn *conns[], int nconns)
+{
+    struct inet_sock *isk;
+    int i, err, kick;
+
+    if (!nconns)
+        return 0;
+
+    /* Now we lock the pool and add the connections to it */
+    write_lock(&herder->pool_lock);
+    for (i = 0; i < nconns; i++) {
+        conns[i]->herder = herder;
+        list_add(&conns[i]->list, &herder->conn_pool);
+    }
+    write_unlock(&herder->pool_lock);
 
-    /* Now we lock the pool, add the connection
-     * to the pool in and make sure to increase
-     * our pool count! */
-    if (least_loaded) {
-        write_lock(&least_loaded->pool_lock);
-        list_add(&connection->list, &least_loaded->conn_pool);
-        atomic_inc(&least_loaded->pool_size);
-        write_unlock(&least_loaded->pool_lock);
+    for (i = 0; i < nconns; i++) {
+        isk = inet_sk(conns[i]->csock->sk);
         printk(KERN_ALERT "Connection Created on Pool: %u\n for: %u.%u.%u.%u:%d", 
-               least_loaded->cpu,
+               herder->cpu,
                NIPQUAD(isk->daddr),
                isk->dport);
     }
 
-    /* And now add it to our epoll interface */
-    tcp_epoll_insert(least_loaded->eventpoll, connection, POLLIN);
+    /* Start their clocks, the herder may be asleep past their deadlines */
+    kick = 0;
+    for (i = 0; i < nconns; i++)
+        kick |= tcpha_fe_timer_add(&herder->wheel, &conns[i]->timer,
+                                   tcpha_fe_conn_deadline(conns[i]));
+    if (kick)
+        tcp_epoll_kick(herder->eventpoll);
 
-    return 0;
+    /* And now add them to our epoll interface */
+    err = tcp_epoll_insert_batch(herder->eventpoll, conns, nconns,
+                                 tcpha_fe_conn_epoll_flags());
+    if (err < nconns) {
+        printk(KERN_ALERT "Err adding connections to epoll\n");
+        /* Anyone without an item would never hear a thing. They own
+         * their sockets now, so they go with them. */
+        for (i = 0; i < nconns; i++) {
+            if (conns[i]->eventpoll != herder->eventpoll)
+                tcpha_fe_conn_destroy(herder, conns[i]);
+        }
+    }
+
+    return err < 0 ? 0 : err;
+}
+
+int tcpha_fe_herder_set_inline(struct herder_list *herders, int cpu, int budget)
+{
+    struct tcpha_fe_herder *herder;
+
+    if (cpu < 0 || cpu >= NR_CPUS || budget < 0)
+        return -EINVAL;
+    read_lock(&herders->lock);
+    herder = herders->by_cpu[cpu];
+    if (herder)
+        herder->inline_budget = budget;
+    read_unlock(&herders->lock);
+
+    return herder ? 0 : -ENODEV;
 }
 
 /* Tear down function */
 /*---------------------------------------------------------------------------*/
+/*
+ * Unhook a connection from its herder and drop the pool's reference. It is
+ * freed once any queued work or tcp_epoll_wait caller is done with it.
+ * Whoever is processing it (another herder that stole it, say) is waited
+ * out first, they may still be using its herder.
+ */
 extern void tcpha_fe_conn_destroy(struct tcpha_fe_herder *herder, struct tcpha_fe_conn *conn)
 {
+    /* Our own reference, the pool's may be the last */
+    tcpha_fe_conn_get(conn);
+    while (test_and_set_bit(TCPHA_CONN_RUNNING, &conn->flags))
+        schedule_timeout_uninterruptible(1);
+
+    __tcpha_fe_conn_destroy(herder, conn);
+
+    clear_bit(TCPHA_CONN_RUNNING, &conn->flags);
+    smp_mb__after_clear_bit();
+    tcpha_fe_conn_put(conn);
+}
+
+/* The same, for whoever is processing it (holding TCPHA_CONN_RUNNING) */
+extern void __tcpha_fe_conn_destroy(struct tcpha_fe_herder *herder, struct tcpha_fe_conn *conn)
+{
+    /* Only the first caller gets to tear it down */
+    if (test_and_set_bit(TCPHA_CONN_DEAD, &conn->flags))
+        return;
+
     tcp_epoll_remove(herder->eventpoll, conn);
+    tcpha_fe_timer_del(&herder->wheel, &conn->timer);
 
     write_lock(&herder->pool_lock);
     list_del(&conn->list);
+    atomic_dec(&herder->pool_size);
     write_unlock(&herder->pool_lock);
+    atomic_dec(&herder->herders->nconns);
+
+    tcpha_fe_conn_put(conn);
+}
+
+/*
+ * Move a live connection into another herders pool and epoll. The caller
+ * must hold a reference. Wakeups racing the move are not lost, inserting
+ * into the new epoll polls the socket for anything already pending.
+ */
+static void tcpha_fe_conn_migrate(struct tcpha_fe_conn *conn, struct tcpha_fe_herder *to)
+{
+    struct tcpha_fe_herder *from;
+    int err = 0;
+
+    /* Keep the processor (and so tcpha_fe_conn_destroy) off it while it moves */
+    while (test_and_set_bit(TCPHA_CONN_RUNNING, &conn->flags))
+        schedule_timeout_uninterruptible(1);
+
+    from = conn->herder;
+    if (test_bit(TCPHA_CONN_DEAD, &conn->flags) || from == to)
+        goto done;
+
+    tcp_epoll_remove(from->eventpoll, conn);
+    tcpha_fe_timer_del(&from->wheel, &conn->timer);
+
+    write_lock(&from->pool_lock);
+    list_del(&conn->list);
+    atomic_dec(&from->pool_size);
+    write_unlock(&from->pool_lock);
+
+    conn->herder = to;
+    write_lock(&to->pool_lock);
+    list_add(&conn->list, &to->conn_pool);
+    atomic_inc(&to->pool_size);
+    write_unlock(&to->pool_lock);
+
+    if (tcpha_fe_timer_add(&to->wheel, &conn->timer, tcpha_fe_conn_deadline(conn)))
+        tcp_epoll_kick(to->eventpoll);
+    err = tcp_epoll_insert(to->eventpoll, conn, tcpha_fe_conn_epoll_flags());
 
+    done:
+    clear_bit(TCPHA_CONN_RUNNING, &conn->flags);
+    smp_mb__after_clear_bit();
+    /* Without an item it would never hear a thing, same as on accept */
+    if (err) {
+        printk(KERN_ALERT "Err adding migrated connection to epoll\n");
+        tcpha_fe_conn_destroy(to, conn);
+        return;
+    }
+    /* Anything that turned up while we held it still needs doing */
+    if (atomic_read(&conn->pending_events))
+        tcpha_fe_conn_queue_events(conn, to->processor_work, 0);
+}
+
+unsigned int tcpha_fe_conn_epoll_flags(void)
+{
+    unsigned int flags = POLLIN;
+
+    if (tcphafe_oneshot)
+        flags |= TCP_EPOLLONESHOT;
+    if (tcphafe_edge)
+        flags |= TCP_EPOLLET;
+    return flags;
+}
+
+void tcpha_fe_conn_free(struct tcpha_fe_conn *conn)
+{
     if (conn->csock)
         sock_release(conn->csock);
     conn->csock = NULL;
     if (conn->request.hdr)
         http_header_free(conn->request.hdr);
     conn->request.bodylen = 0;
-    
 
     kmem_cache_free(tcpha_fe_conn_cachep, conn);
 }
 
+void tcpha_fe_conn_queue_events(struct tcpha_fe_conn *conn, struct workqueue_struct *processor, unsigned int events)
+{
+    tcpha_fe_conn_add_events(conn, events);
+
+    /* The work holds a reference while it is queued. queue_work refuses
+     * if it is already queued, in which case the work that is queued
+     * will pick up these events too. */
+    tcpha_fe_conn_get(conn);
+    if (!queue_work(processor, &conn->work))
+        tcpha_fe_conn_put(conn);
+}
+
 /*
  * Kill a list of connection herders. Kill them dead.
  */
 static void destroy_connection_herders(struct herder_list *herders)
 {   
     struct tcpha_fe_herder *herder, *next;
+    LIST_HEAD(stopped);
     int err = 0;
     printk(KERN_ALERT "Destroying Connections ... ");
 
+    /* Stop every herder before freeing any, one could still be
+     * processing a connection it stole from another */
     list_for_each_entry_safe(herder, next, &herders->list, herder_list) {
         if (!herder) {
             printk(KERN_ALERT "Herder Error\n");
             continue;
         }
+        write_lock(&herders->lock);
+        herder_list_remove(herders, herder);
+        write_unlock(&herders->lock);
+        list_add_tail(&herder->herder_list, &stopped);
+
         printk(KERN_ALERT "   Stoping Herder %u ... ", herder->cpu);
-        /* Tell the epoll to go ahead and wake */
-        set_bit(0, &herder->eventpoll->should_wake);
-        /* Trigger the wake with kthread stop */
+        /* kthread_stop wakes the poller, tcp_epoll_wait won't sleep again */
         err = kthread_stop(herder->task);
         if (err)
             printk(KERN_ALERT "Error Killing Proc\n");
+    }
+
+    list_for_each_entry_safe(herder, next, &stopped, herder_list) {
+        list_del_init(&herder->herder_list);
         /* We need to remove the epoll stuff before killing the connection
          * other wise we will end up with bad memory access on the socket */
         printk(KERN_ALERT "Destroying Herder %u\n", herder->cpu);
@@ -297,17 +1053,118 @@ static void destroy_connection_herders(struct herder_list *herders)
 int destroy_connections(struct herder_list *herders)
 {
     int err = 0;
+    int node;
+
+    /* Nobody reading the herders' stats either */
+    remove_proc_entry(TCPHA_STATS_PROC, NULL);
+    remove_proc_entry(TCPHA_INLINE_PROC, NULL);
+    /* No more herders coming or going */
+    unregister_cpu_notifier(&herders->cpu_notifier);
+    /* Or connections being moved between them */
+    if (herders->rebalancing) {
+        herders->rebalancing = 0;
+        if (!cancel_delayed_work(&herders->rebalance_work))
+            flush_workqueue(herders->processors);
+    }
     destroy_connection_herders(herders);
 
+    for (node = 0; node < MAX_NUMNODES; node++) {
+        if (!atomic_read(&tcpha_fe_node_hits[node]) &&
+            !atomic_read(&tcpha_fe_node_misses[node]))
+            continue;
+        printk(KERN_ALERT "Node %d: %d allocations local, %d remote\n", node,
+               atomic_read(&tcpha_fe_node_hits[node]),
+               atomic_read(&tcpha_fe_node_misses[node]));
+    }
+
     if (atomic_dec_and_test(&mem_cache_use)) {
         err = kmem_cache_destroy(tcpha_fe_conn_cachep);
-        err |= kmem_cache_destroy(work_struct_cachep);
     }
     return err;
 }
 
-/* TODO: We really shouldn't be allocing and deallocing here, we can setup
-   the tcpha_fe_conn to be handed of directly I think... */
+/* Reads /proc/tcphafe_stats: where connections were allocated against where
+ * they ran, and how each herder's busy polling is doing. Only one page. */
+static int herder_read_stats(char *page, char **start, off_t off, int count, int *eof, void *data)
+{
+    struct herder_list *herders = data;
+    struct tcpha_fe_herder *herder;
+    int len = 0;
+    int node;
+
+    for (node = 0; node < MAX_NUMNODES; node++) {
+        if (!atomic_read(&tcpha_fe_node_hits[node]) &&
+            !atomic_read(&tcpha_fe_node_misses[node]))
+            continue;
+        len += scnprintf(page + len, PAGE_SIZE - len,
+                         "node %d: %d local %d remote\n", node,
+                         atomic_read(&tcpha_fe_node_hits[node]),
+                         atomic_read(&tcpha_fe_node_misses[node]));
+    }
+
+    read_lock(&herders->lock);
+    list_for_each_entry(herder, &herders->list, herder_list) {
+        len += scnprintf(page + len, PAGE_SIZE - len,
+                         "herder %u: %lu spin hits %lu spin misses (budget %dus)\n",
+                         herder->cpu, herder->eventpoll->stat_spin_hits,
+                         herder->eventpoll->stat_spin_misses,
+                         herder->eventpoll->busy_poll_us);
+    }
+    read_unlock(&herders->lock);
+
+    return herder_proc_done(page, start, off, count, eof, len);
+}
+
+/* Reads /proc/tcphafe_inline: each herders inline budget */
+static int herder_read_inline(char *page, char **start, off_t off, int count, int *eof, void *data)
+{
+    struct herder_list *herders = data;
+    struct tcpha_fe_herder *herder;
+    int len = 0;
+
+    read_lock(&herders->lock);
+    list_for_each_entry(herder, &herders->list, herder_list) {
+        len += scnprintf(page + len, PAGE_SIZE - len, "%u %d\n",
+                         herder->cpu, herder->inline_budget);
+    }
+    read_unlock(&herders->lock);
+
+    return herder_proc_done(page, start, off, count, eof, len);
+}
+
+/* Writing "<cpu> <budget>" sets that cpus herders inline budget */
+static int herder_write_inline(struct file *file, const char __user *buffer, unsigned long count, void *data)
+{
+    struct herder_list *herders = data;
+    char buf[32];
+    int cpu, budget, err;
+
+    if (count >= sizeof(buf))
+        return -EINVAL;
+    if (copy_from_user(buf, buffer, count))
+        return -EFAULT;
+    buf[count] = '\0';
+
+    if (sscanf(buf, "%d %d", &cpu, &budget) != 2)
+        return -EINVAL;
+    err = tcpha_fe_herder_set_inline(herders, cpu, budget);
+    return err ? err : count;
+}
+
+/* Hand back the part of a one page proc read that was asked for */
+static int herder_proc_done(char *page, char **start, off_t off, int count, int *eof, int len)
+{
+    if (len <= off + count)
+        *eof = 1;
+    *start = page + off;
+    len -= off;
+    if (len > count)
+        len = count;
+    if (len < 0)
+        len = 0;
+    return len;
+}
+
 /* This is function responsible for maintaing our connection
  * pools, polling the open connections, and scheduling work to be
  * done on connections when apropriate.
@@ -319,44 +1176,303 @@ int tcpha_fe_herder_run(void *data)
     struct tcpha_fe_herder *herder = (struct tcpha_fe_herder*)data;
     struct tcpha_fe_conn **conns;
     int numevents = 0;
-    int i;
-    int err = 0;
-    struct event_process *ep;
+    int budget, steal;
+    unsigned long next;
 
     printk(KERN_ALERT "Running Herder %u\n", herder->cpu);
 
-    conns = kmalloc(sizeof(struct tcpha_fe_conn_cachep*) * MAX_EVENTS, GFP_KERNEL);
-    /* Wait for kthread_stop */
-    set_current_state(TASK_INTERRUPTIBLE);
+    conns = kmalloc_node(sizeof(struct tcpha_fe_conn *) * MAX_EVENTS, GFP_KERNEL,
+                         herder->node);
+    /* Wait for kthread_stop. tcp_epoll_wait does our sleeping, we stay
+     * TASK_RUNNING so processing inline is free to sleep too. */
     while (!kthread_should_stop()) {
-        numevents = tcp_epoll_wait(herder->eventpoll, conns, MAX_EVENTS);
+        /* Like NAPI, take a bounded pass over the oldest ready
+         * connections. Whatever is left (and whatever becomes ready
+         * again) waits behind them for the next pass. */
+        budget = tcphafe_herder_budget;
+        if (budget < 1 || budget > MAX_EVENTS)
+            budget = MAX_EVENTS;
+        /* Sleep no longer than the wheel needs turning, so timeouts
+         * are handled here without anything else waking us */
+        if (tcpha_fe_wheel_next(&herder->wheel, &next))
+            numevents = tcp_epoll_wait_until(herder->eventpoll, conns, budget, next);
+        else
+            numevents = tcp_epoll_wait(herder->eventpoll, conns, budget,
+                                       MAX_SCHEDULE_TIMEOUT);
+        herder->events += numevents;
+        /* Nothing of our own, see if a neighbour is backed up */
+        if (!numevents) {
+            steal = tcphafe_steal_batch;
+            if (steal < 1 || steal > MAX_EVENTS)
+                steal = MAX_EVENTS;
+            numevents = herder_steal(herder, conns, steal);
+        }
+        /* Throw out anyone who has overstayed, alongside the rest */
+        if (tcpha_fe_wheel_due(&herder->wheel))
+            numevents += herder_reap(herder, conns + numevents,
+                                     MAX_EVENTS - numevents);
         if (!numevents)
             continue;
 
-        printk(KERN_ALERT "Processing Items:\n");
-
-        for (i = 0; i < numevents; i++) {
-            event_process_alloc(&ep);
-            printk(KERN_ALERT "   Item %d ... ", i);
-            /* Copy the gathered events and clear them */
-            ep->conn = conns[i];
-            ep->events = conns[i]->events;
-            ep->herder = herder;
-            conns[i]->events = 0;
-
-            /* Queue up someone to deal with those events */
-            printk(KERN_ALERT "Adding to workqueue\n");
-            INIT_WORK(&ep->work, process_connection, ep);
-            err = queue_work(herder->processor_work, &ep->work);
-            if (!err)
-                printk(KERN_ALERT "Err adding work for processor\n");
-        }
-        set_current_state(TASK_INTERRUPTIBLE);
+        herder_dispatch(herder, conns, numevents);
+
+        /* Still backed up after a pass, get someone idle to help */
+        if (tcphafe_steal_threshold &&
+            tcp_epoll_backlog(herder->eventpoll) > tcphafe_steal_threshold)
+            herder_call_for_help(herder);
+
+        /* Used the whole budget, give the rest of the cpu a look in */
+        if (numevents >= budget)
+            cond_resched();
     }
-    __set_current_state(TASK_RUNNING);
 
     printk(KERN_ALERT "Herder %u Shutting Down\n", herder->cpu);
     kfree(conns);
 
     return 0;
 }
+
+/*
+ * Process or queue the connections tcp_epoll_wait (or a steal) gave us,
+ * dropping the references it took.
+ */
+static void herder_dispatch(struct tcpha_fe_herder *herder, struct tcpha_fe_conn **conns, int numevents)
+{
+    int i;
+
+    printk(KERN_ALERT "Processing Items:\n");
+
+    for (i = 0; i < numevents; i++) {
+        if (i < herder->inline_budget) {
+            /* Small requests are cheaper to just do here than
+             * to bounce to a processor thread */
+            process_connection_events(conns[i]);
+            herder->stat_inline++;
+        } else {
+            printk(KERN_ALERT "   Item %d ... Adding to workqueue\n", i);
+            /* Hand the gathered events off */
+            tcpha_fe_conn_queue_events(conns[i], herder->processor_work, 0);
+            herder->stat_queued++;
+        }
+        /* Drop the reference tcp_epoll_wait gave us */
+        tcpha_fe_conn_put(conns[i]);
+    }
+}
+
+/*
+ * Take a batch of ready connections from the most backed up herder, if
+ * any is past tcphafe_steal_threshold. The connections stay in their own
+ * herders pool, we just do the processing for them.
+ */
+static int herder_steal(struct tcpha_fe_herder *herder, struct tcpha_fe_conn **conns, int maxevents)
+{
+    struct tcpha_fe_herder *victim = NULL;
+    struct tcpha_fe_herder *other;
+    int backlog, most = tcphafe_steal_threshold;
+    int stolen = 0;
+
+    if (!tcphafe_steal_threshold)
+        return 0;
+
+    read_lock(&herder->herders->lock);
+    list_for_each_entry(other, &herder->herders->list, herder_list) {
+        backlog = tcp_epoll_backlog(other->eventpoll);
+        if (other != herder && backlog > most) {
+            most = backlog;
+            victim = other;
+        }
+    }
+
+    /* Leave the owner at least half of it */
+    if (victim)
+        stolen = tcp_epoll_steal(victim->eventpoll, conns,
+                                 min(maxevents, most / 2));
+    read_unlock(&herder->herders->lock);
+
+    if (stolen) {
+        herder->stat_steals++;
+        herder->stat_stolen += stolen;
+    }
+    return stolen;
+}
+
+/*
+ * When a connection has to go: the earliest of its header, idle and
+ * lifetime deadlines. With none of them set it is looked at again
+ * once a full turn of the wheel.
+ */
+static unsigned long tcpha_fe_conn_deadline(struct tcpha_fe_conn *conn)
+{
+    unsigned long deadline = jiffies + TCPHA_WHEEL_RANGE * TCPHA_WHEEL_TICK;
+    unsigned long d;
+
+    if (tcphafe_header_timeout > 0 && !test_bit(TCPHA_CONN_HEADER, &conn->flags)) {
+        d = conn->created + tcphafe_header_timeout * HZ;
+        if (time_before(d, deadline))
+            deadline = d;
+    }
+    if (tcphafe_idle_timeout > 0) {
+        d = conn->last_active + tcphafe_idle_timeout * HZ;
+        if (time_before(d, deadline))
+            deadline = d;
+    }
+    if (tcphafe_lifetime > 0) {
+        d = conn->created + tcphafe_lifetime * HZ;
+        if (time_before(d, deadline))
+            deadline = d;
+    }
+    return deadline;
+}
+
+struct herder_reaped {
+    struct tcpha_fe_conn **conns;
+    int count;
+};
+
+/*
+ * Called by the wheel (under its lock) for each connection whose timer
+ * came due. The wheel only knows when we last armed it, so check the
+ * real deadline and go round again if it has moved.
+ */
+static unsigned long herder_conn_expired(struct tcpha_fe_timer *timer, void *data)
+{
+    struct tcpha_fe_conn *conn = container_of(timer, struct tcpha_fe_conn, timer);
+    struct herder_reaped *reaped = data;
+    unsigned long deadline;
+
+    /* Already on its way out */
+    if (test_bit(TCPHA_CONN_DEAD, &conn->flags))
+        return 0;
+
+    deadline = tcpha_fe_conn_deadline(conn);
+    if (time_before(jiffies, deadline))
+        return deadline ? deadline : 1;
+
+    /* Disarming takes the wheel lock, so the pool still holds it */
+    tcpha_fe_conn_get(conn);
+    tcpha_fe_conn_add_events(conn, TCPHA_EVENT_EXPIRED);
+    reaped->conns[reaped->count++] = conn;
+    return 0;
+}
+
+/*
+ * Collect connections that have timed out, to be dispatched like any
+ * other events (the processor tears them down).
+ */
+static int herder_reap(struct tcpha_fe_herder *herder, struct tcpha_fe_conn **conns, int maxevents)
+{
+    struct herder_reaped reaped;
+    int batch = tcphafe_reap_batch;
+
+    /* Reaping nothing would leave the wheel due and the herder spinning */
+    if (batch < 1)
+        batch = 1;
+    if (maxevents > batch)
+        maxevents = batch;
+    if (maxevents <= 0)
+        return 0;
+
+    reaped.conns = conns;
+    reaped.count = 0;
+    tcpha_fe_wheel_expire(&herder->wheel, herder_conn_expired, &reaped, maxevents);
+    return reaped.count;
+}
+
+/*
+ * Compare how many events each herder collected since the last pass, and
+ * if the busiest is well ahead of the quietest move some of its busy
+ * connections across. Runs on the processors, rescheduling itself.
+ */
+static void herder_rebalance(void *data)
+{
+    struct herder_list *herders = data;
+    struct tcpha_fe_herder *herder, *hot = NULL, *cold = NULL;
+    struct tcpha_fe_conn *conns[TCPHA_REBALANCE_BATCH];
+    unsigned long rate, hot_rate = 0, cold_rate = 0;
+    int i, n = 0;
+
+    mutex_lock(&herders->rebalance_lock);
+    read_lock(&herders->lock);
+    list_for_each_entry(herder, &herders->list, herder_list) {
+        rate = herder->events - herder->events_sampled;
+        herder->events_sampled += rate;
+        if (!hot || rate > hot_rate) {
+            hot = herder;
+            hot_rate = rate;
+        }
+        if (!cold || rate < cold_rate) {
+            cold = herder;
+            cold_rate = rate;
+        }
+    }
+    read_unlock(&herders->lock);
+
+    /* Hotplug can't take them away while we hold the rebalance lock */
+    if (hot && hot != cold && hot_rate >= tcphafe_rebalance_min &&
+        hot_rate * 100 > cold_rate * (100 + tcphafe_rebalance_pct))
+        n = herder_rebalance_pick(hot, conns, (hot_rate - cold_rate) / 2);
+
+    /* Migrating re-polls the socket in its new epoll, so wakeups
+     * that race the move still get seen */
+    for (i = 0; i < n; i++) {
+        tcpha_fe_conn_migrate(conns[i], cold);
+        tcpha_fe_conn_put(conns[i]);
+    }
+    if (n) {
+        hot->stat_moved_out += n;
+        cold->stat_moved_in += n;
+        printk(KERN_ALERT "Rebalanced %d connections from Herder %u to %u\n",
+               n, hot->cpu, cold->cpu);
+    }
+    mutex_unlock(&herders->rebalance_lock);
+
+    if (herders->rebalancing)
+        queue_delayed_work(herders->processors, &herders->rebalance_work,
+                           msecs_to_jiffies(tcphafe_rebalance_ms));
+}
+
+/*
+ * Choose connections from the busiest herder adding up to no more than
+ * want events. Each connections activity is counted since the last time
+ * its pool was looked at, which is good enough to tell the chatty ones.
+ * A single connection busier than want is left alone, moving it would
+ * only move the problem. Returns the connections with a reference held.
+ */
+static int herder_rebalance_pick(struct tcpha_fe_herder *hot, struct tcpha_fe_conn **conns, unsigned long want)
+{
+    struct tcpha_fe_conn *conn;
+    unsigned long delta;
+    int n = 0;
+
+    read_lock(&hot->pool_lock);
+    list_for_each_entry(conn, &hot->conn_pool, list) {
+        delta = conn->nevents - conn->nevents_seen;
+        conn->nevents_seen = conn->nevents;
+        if (n == TCPHA_REBALANCE_BATCH || !delta || delta > want ||
+            test_bit(TCPHA_CONN_DEAD, &conn->flags))
+            continue;
+        tcpha_fe_conn_get(conn);
+        conns[n++] = conn;
+        want -= delta;
+    }
+    read_unlock(&hot->pool_lock);
+
+    return n;
+}
+
+/*
+ * Wake one herder with nothing to do, so it comes and steals from us.
+ */
+static void herder_call_for_help(struct tcpha_fe_herder *herder)
+{
+    struct tcpha_fe_herder *other;
+
+    read_lock(&herder->herders->lock);
+    list_for_each_entry(other, &herder->herders->list, herder_list) {
+        if (other != herder && !tcp_epoll_backlog(other->eventpoll)) {
+            tcp_epoll_kick(other->eventpoll);
+            break;
+        }
+    }
+    read_unlock(&herder->herders->lock);
+}
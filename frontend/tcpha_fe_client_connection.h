@@ -17,29 +17,127 @@
 #include <linux/sched.h>
 #include <linux/workqueue.h>
 #include <linux/kthread.h>
+#include <linux/notifier.h>
+#include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/topology.h>
 #include "tcpha_fe_http.h"
+#include "tcpha_fe_timer.h"
 #define MAX_INT 0x7ffffff
 #define TCPHA_EPOLL_SIZE 1024
+/* Most sockets handed to the herders at once */
+#define TCPHA_CONN_BATCH 32
+
+/* Herder placement policies (tcphafe_placement) */
+#define TCPHA_PLACE_TWO_CHOICES 0
+#define TCPHA_PLACE_LEAST_LOADED 1
+#define TCPHA_PLACE_FLOW_AFFINITY 2
+#define TCPHA_PLACE_MAX 3
+
+/* Most connections the rebalancer moves per pass */
+#define TCPHA_REBALANCE_BATCH 8
 
 extern kmem_cache_t *tcpha_fe_conn_cachep;
 struct tcp_eventpoll; /* Pre dec so I can use it here */
 
+/* Where our per herder and per connection allocations really landed,
+ * compared against the node we asked for */
+extern atomic_t tcpha_fe_node_hits[MAX_NUMNODES];
+extern atomic_t tcpha_fe_node_misses[MAX_NUMNODES];
+
+static inline void tcpha_fe_count_node_alloc(const void *obj, int node)
+{
+	if (!obj || node < 0)
+		return;
+	if (page_to_nid(virt_to_page(obj)) == node)
+		atomic_inc(&tcpha_fe_node_hits[node]);
+	else
+		atomic_inc(&tcpha_fe_node_misses[node]);
+}
+
 struct http_request;
+struct tcp_ep_item;
+
+/* Bits in tcpha_fe_conn flags */
+#define TCPHA_CONN_DEAD 0	/* Torn down, only references keep it around */
+#define TCPHA_CONN_RUNNING 1	/* Someone is processing its events */
+#define TCPHA_CONN_HEADER 2	/* A full request header has been read */
+
+/* Pseudo event a herder hands over when a connection overstays its
+ * timeouts, well clear of the real poll bits */
+#define TCPHA_EVENT_EXPIRED 0x08000000
 
 /* A connection with client */
 /* TODO: This needs to go in a seperate header file, its used infar to many places */
 struct tcpha_fe_conn {
 	rwlock_t lock;
-	unsigned int events;
 	struct socket *csock;	/* socket connected to client */
 	struct list_head list;	/* d-linked list head */ 
 	struct http_request request;
     atomic_t alive;
+
+	struct tcpha_fe_herder *herder;	/* herder whose pool we are in */
+	unsigned long flags;	/* TCPHA_CONN_* bits */
+	atomic_t refcnt;	/* the pool, its epoll item, queued work and tcp_epoll_wait callers */
+
+	/* Events waiting for the processor (tcp_epoll_wait puts them here),
+	 * and the work that will process them. Events are OR'ed in, so a
+	 * connection is only ever queued once no matter how many events
+	 * arrive before it runs. */
+	atomic_t pending_events;
+	struct work_struct work;
+
+	/* Our item in the eventpoll we are in, so changing or removing it
+	 * needs no lookup. Set and cleared by the eventpoll. */
+	struct tcp_ep_item *ep_item;
+	struct tcp_eventpoll *eventpoll;
+
+	/* Aging, see tcpha_fe_conn_deadline. last_active is only a hint
+	 * and is updated without any locking. */
+	struct tcpha_fe_timer timer;	/* In our herders wheel */
+	unsigned long created;	/* jiffies */
+	unsigned long last_active;	/* jiffies of the last event processed */
+
+	/* Activity, for the rebalancer. nevents is bumped by whoever
+	 * processes the connection, nevents_seen by the rebalancer. */
+	unsigned long nevents;
+	unsigned long nevents_seen;
 };
 
 struct herder_list {
 	struct list_head list;
 	rwlock_t lock;
+	/* The herder bound to each cpu (NULL if there is none) */
+	struct tcpha_fe_herder *by_cpu[NR_CPUS];
+	/* The herders packed together, for picking at random */
+	struct tcpha_fe_herder *array[NR_CPUS];
+	int count;
+
+	/* Processors every herder hands work to */
+	struct workqueue_struct *processors;
+
+	/* Starts and stops herders as cpus come and go */
+	struct notifier_block cpu_notifier;
+
+	/* Periodically moves busy connections off the busiest herder.
+	 * rebalance_lock keeps it and hotplug from moving connections
+	 * at the same time. */
+	struct work_struct rebalance_work;
+	struct mutex rebalance_lock;
+	int rebalancing;
+
+	/* Admission control */
+	atomic_t nconns; /* Connections across all herders */
+	int max_conns; /* Connections allowed across all herders */
+	int max_per_herder; /* Connections allowed in one herder, 0 is no limit */
+};
+
+/* A way of choosing which herder a new connection goes to. Called with
+ * the herder list read locked, rx_cpu is the cpu the flow arrived on
+ * (or -1). */
+struct tcpha_fe_placement {
+	const char *name;
+	struct tcpha_fe_herder *(*pick)(struct herder_list *herders, int rx_cpu);
 };
 
 struct tcpha_fe_herder {
@@ -48,20 +146,61 @@ struct tcpha_fe_herder {
 	atomic_t pool_size; /* Number of connections currently in pool */
 
 	int cpu; /* The cpu this herders is bound to */
+	int node; /* The memory node of that cpu, our allocations go here */
 	struct tcp_eventpoll *eventpoll; /* My epoller */
 	
 	struct list_head herder_list; /* This is for the list of herders */
+	struct herder_list *herders; /* The list we are on */
 
 	struct work_struct work; /* This is my own job item */
 	struct workqueue_struct *processor_work; /* This is the job item
 												for my processor */
 
 	struct task_struct *task; /* The task this boy is actually running in */
+
+	/* Times out the connections in our pool */
+	struct tcpha_fe_wheel wheel;
+
+	/* Run to completion, process up to this many connections per pass
+	 * in the herder itself before using the processor. 0 is off. */
+	int inline_budget;
+
+	/* Stats, only touched by the herder thread */
+	unsigned long stat_inline; /* Connections processed in the herder */
+	unsigned long stat_queued; /* Connections handed to the processor */
+	unsigned long stat_steals; /* Times we took work from another herder */
+	unsigned long stat_stolen; /* Connections we took from other herders */
+
+	/* Events collected from our own epoll, and what the rebalancer
+	 * saw last time it looked */
+	unsigned long events;
+	unsigned long events_sampled;
+	unsigned long stat_moved_in; /* Connections rebalanced to us */
+	unsigned long stat_moved_out; /* Connections rebalanced away */
 };
 
+extern int tcphafe_placement;
+
+/* The listener records the cpu a connection arrived on (keyed by its
+ * sock, the socket itself is left alone), the herders take it back out
+ * when placing it. Taking returns -1 if the cpu was never recorded. */
+extern void tcpha_fe_set_rx_cpu(struct sock *sk, int cpu);
+extern int tcpha_fe_take_rx_cpu(struct sock *sk);
+
 extern int init_connections(struct herder_list *herders, struct workqueue_struct *processors);
 extern int destroy_connections(struct herder_list *herders);
 
+/**
+ * Set how many connections the herders will take before new 
+ * ones are refused. 
+ * 
+ * @param herders The list of herders
+ * @param max_conns Connections allowed over all the herders
+ * @param max_per_herder Connections allowed in one herder, 0 for 
+ *                       no per herder limit.
+ */
+extern void tcpha_fe_conn_set_budget(struct herder_list *herders, int max_conns, int max_per_herder);
+
 /**
  * Add a socket to be "watched" for a new connection into the 
  * list of herders. 
@@ -76,6 +215,39 @@ extern int destroy_connections(struct herder_list *herders);
  */
 extern int tcpha_fe_conn_create(struct herder_list *herders, struct socket *sock);
 
+/**
+ * Add a socket to the herder bound to a given cpu, so an acceptor 
+ * running on that cpu keeps the connection local. Falls back to 
+ * tcpha_fe_conn_create if that cpu has no herder. 
+ * 
+ * @param herders The list of herders which will be watching 
+ * @param sock 
+ * @param cpu The cpu whose herder should own the connection 
+ * 
+ * @return int If less than 0 there was an err adding to the 
+ *         herders (try again or drop the connection).
+ */
+extern int tcpha_fe_conn_create_local(struct herder_list *herders, struct socket *sock, int cpu);
+
+/**
+ * Add a batch of sockets to the herders. The batch is spread 
+ * over the herders under a single hold of the herder list lock, 
+ * and each herders share goes into its pool and epoll under a 
+ * single hold of their locks. 
+ * 
+ * @param herders The list of herders which will be watching 
+ * @param socks Up to TCPHA_CONN_BATCH sockets. Every socket the 
+ *              herders take ownership of is set to NULL, anything
+ *              left (for instance because the connection budget is 
+ *              spent) is still the callers to release.
+ * @param nsocks The number of sockets in socks 
+ * @param cpu The cpu whose herder should own the connections, or 
+ *            -1 to spread them over the least loaded herders. 
+ * 
+ * @return int The number of sockets taken.
+ */
+extern int tcpha_fe_conn_create_batch(struct herder_list *herders, struct socket *socks[], int nsocks, int cpu);
+
 
 /**
  * The main body loop for a herder
@@ -91,5 +263,68 @@ extern int tcpha_fe_conn_create(struct herder_list *herders, struct socket *sock
  */
 extern int tcpha_fe_herder_run(void *herder);
 extern void tcpha_fe_conn_destroy(struct tcpha_fe_herder *herder, struct tcpha_fe_conn *conn);
+/* For the processor, which already holds TCPHA_CONN_RUNNING */
+extern void __tcpha_fe_conn_destroy(struct tcpha_fe_herder *herder, struct tcpha_fe_conn *conn);
+
+/**
+ * Free a connection once the last reference to it is gone, use 
+ * tcpha_fe_conn_put rather than calling this. 
+ */
+extern void tcpha_fe_conn_free(struct tcpha_fe_conn *conn);
+
+/**
+ * The flags connections are polled with (tcp_epoll_insert). When they
+ * include TCP_EPOLLONESHOT whoever processes a connection re-arms it
+ * with these once done.
+ */
+extern unsigned int tcpha_fe_conn_epoll_flags(void);
+
+static inline void tcpha_fe_conn_get(struct tcpha_fe_conn *conn)
+{
+	atomic_inc(&conn->refcnt);
+}
+
+static inline void tcpha_fe_conn_put(struct tcpha_fe_conn *conn)
+{
+	if (atomic_dec_and_test(&conn->refcnt))
+		tcpha_fe_conn_free(conn);
+}
+
+/* Merge events into those pending on a connection */
+static inline void tcpha_fe_conn_add_events(struct tcpha_fe_conn *conn, unsigned int events)
+{
+	int old;
+
+	/* No atomic_or, so do it the hard way */
+	do {
+		old = atomic_read(&conn->pending_events);
+	} while (atomic_cmpxchg(&conn->pending_events, old, old | events) != old);
+}
+
+/**
+ * Hand events on a connection to the processor. The events are 
+ * merged with any already pending (pass 0 to just hand over what 
+ * is pending), and the connection's work is only queued if it is 
+ * not queued already. 
+ * 
+ * @param conn The connection, the caller must hold a reference
+ * @param processor The workqueue to queue it on
+ * @param events The poll events that occured
+ */
+extern void tcpha_fe_conn_queue_events(struct tcpha_fe_conn *conn, struct workqueue_struct *processor, unsigned int events);
+
+/**
+ * Choose whether a herder processes connections itself. 
+ * 
+ * @param herders The list of herders
+ * @param cpu The cpu of the herder to change
+ * @param budget How many connections per pass to process in 
+ *               the herder, 0 hands everything to the processor.
+ * 
+ * @return int Less than 0 if there is no herder on that cpu.
+ *
+ * Also done by writing "<cpu> <budget>" to /proc/tcphafe_inline.
+ */
+extern int tcpha_fe_herder_set_inline(struct herder_list *herders, int cpu, int budget);
 
 #endif /* TCPHA_FE_CLIENT_CONNECTION_H_ */
@@ -3,14 +3,16 @@
 #include "tcpha_fe_socket_functions.h"
 #include "tcpha_fe_http.h"
 #include "tcpha_fe_utils.h"
-
-struct kmem_cache *event_process_memcache_ptr;
+#include "tcpha_fe_poll.h"
 
 /* Private Methods */
 /*---------------------------------------------------------------------------*/
+static void process_events(struct tcpha_fe_conn *conn, unsigned int events);
 static inline void process_pollin(struct tcpha_fe_conn *conn);
-static inline void process_pollrdhup(struct tcpha_fe_herder *herder, struct tcpha_fe_conn *conn);
+static inline void process_pollrdhup(struct tcpha_fe_conn *conn);
+static inline void process_expired(struct tcpha_fe_conn *conn);
 static void pick_backend(struct tcpha_fe_conn *conn, int hash);
+static inline void process_rearm(struct tcpha_fe_conn *conn);
 
 /* Constructore/destructor methods */
 /*---------------------------------------------------------------------------*/
@@ -18,10 +20,6 @@ static void pick_backend(struct tcpha_fe_conn *conn, int hash);
 int processor_init(struct workqueue_struct **processor)
 {
 	*processor = create_workqueue("TCPHA_Connection_Processor");
-	event_process_memcache_ptr = kmem_cache_create("TCPHA_Event_Process", 
-												sizeof(struct event_process),
-													0, SLAB_HWCACHE_ALIGN | SLAB_PANIC,
-													NULL, NULL);
 
 	http_init();
 	return 0;
@@ -31,32 +29,58 @@ void processor_destroy(struct workqueue_struct *processor)
 {
 	flush_workqueue(processor);
 	destroy_workqueue(processor);
-	kmem_cache_destroy(event_process_memcache_ptr);
 	http_destroy();
 }
 
 
-void event_process_alloc(struct event_process** ep)
-{
-	*ep = kmem_cache_alloc(event_process_memcache_ptr, GFP_KERNEL);
-}
-void event_process_free(struct event_process* ep)
-{
-	kmem_cache_free(event_process_memcache_ptr, ep);
-}
-
-
 /* External (public) methods */
 /*---------------------------------------------------------------------------*/
 /* TODO: Do we really need to be doing coping at all? Just start a state machine reading from
    the sockets input buffer? */
 void process_connection(void *data)
 {
-    struct event_process *ep = data;
-    struct tcpha_fe_conn *conn = ep->conn;
-    unsigned int events = ep->events;
-    struct inet_sock *sk = inet_sk(conn->csock->sk);
+    struct tcpha_fe_conn *conn = data;
+
+    process_connection_events(conn);
+
+    /* We are done processing them, drop the reference our work held */
+    tcpha_fe_conn_put(conn);
+}
+
+void process_connection_events(struct tcpha_fe_conn *conn)
+{
+    /* Only one of us works on a connection at a time */
+    if (test_and_set_bit(TCPHA_CONN_RUNNING, &conn->flags))
+        return;
+
+    do {
+        process_events(conn, atomic_xchg(&conn->pending_events, 0));
+        process_rearm(conn);
+        clear_bit(TCPHA_CONN_RUNNING, &conn->flags);
+        smp_mb__after_clear_bit();
+        /* Anyone who turned up while we were busy left their events
+         * behind for us, so check before leaving */
+    } while (atomic_read(&conn->pending_events) &&
+             !test_and_set_bit(TCPHA_CONN_RUNNING, &conn->flags));
+}
 
+static void process_events(struct tcpha_fe_conn *conn, unsigned int events)
+{
+    struct inet_sock *sk;
+
+    /* Torn down while we sat in the queue */
+    if (!events || test_bit(TCPHA_CONN_DEAD, &conn->flags))
+        return;
+
+    /* Overstayed its welcome, nothing else matters */
+    if (events & TCPHA_EVENT_EXPIRED) {
+        process_expired(conn);
+        return;
+    }
+    conn->last_active = jiffies;
+    conn->nevents++;
+
+    sk = inet_sk(conn->csock->sk);
     printk(KERN_ALERT "Working on connection %u.%u.%u.%u ... ", NIPQUAD(sk->daddr));
     /* Run throught he events to process */
     if (events & POLLIN) {
@@ -65,11 +89,20 @@ void process_connection(void *data)
 
     /* Remove the socket from the list */
     if (events & POLLRDHUP) {
-        process_pollrdhup(ep->herder, conn);
+        process_pollrdhup(conn);
     }
+}
 
-    /* We are done processing them, free the item we where processing */
-    event_process_free(ep);
+/* Done with what we were handed, let the epoll report the connection
+ * again. Holding RUNNING keeps it from being migrated under us. */
+static inline void process_rearm(struct tcpha_fe_conn *conn)
+{
+    unsigned int flags = tcpha_fe_conn_epoll_flags();
+
+    if (!(flags & TCP_EPOLLONESHOT) || test_bit(TCPHA_CONN_DEAD, &conn->flags))
+        return;
+    if (conn->ep_item)
+        tcp_epoll_item_setflags(conn->ep_item, flags);
 }
 
 /* Handlers for different poll events */
@@ -90,7 +123,8 @@ static inline void process_pollin(struct tcpha_fe_conn *conn)
         vec.iov_len = MAX_INPUT_SIZE - hdrlen;
     } else {
         /* Else setup the new buffer */
-        conn->request.hdr = http_header_alloc();
+        /* Keep it with the herder that owns the connection */
+        conn->request.hdr = http_header_alloc(conn->herder->node);
         conn->request.hdrlen = 0;
         vec.iov_base = &conn->request.hdr->buffer;
     }
@@ -113,6 +147,8 @@ static inline void process_pollin(struct tcpha_fe_conn *conn)
     if (err) {
         return;
     } else {
+        /* The header timeout no longer applies */
+        set_bit(TCPHA_CONN_HEADER, &conn->flags);
         /* Pick a backend, and schedule an send it on */
         printk(KERN_ALERT "Calculated Hash: %d\n", hash);
     }
@@ -123,11 +159,19 @@ static void pick_backend(struct tcpha_fe_conn *conn, int hash)
 
 }
 
-static inline void process_pollrdhup(struct tcpha_fe_herder *herder, struct tcpha_fe_conn *conn)
+static inline void process_pollrdhup(struct tcpha_fe_conn *conn)
 {
     struct inet_sock *sk = inet_sk(conn->csock->sk);
     if (atomic_dec_and_test(&conn->alive)) {
         printk(KERN_ALERT "Removing Connection: %u.%u.%u.%u\n", NIPQUAD(sk->daddr));
-        tcpha_fe_conn_destroy(herder, conn);
+        __tcpha_fe_conn_destroy(conn->herder, conn);
     }
 }
+
+static inline void process_expired(struct tcpha_fe_conn *conn)
+{
+    struct inet_sock *sk = inet_sk(conn->csock->sk);
+
+    printk(KERN_ALERT "Timing out Connection: %u.%u.%u.%u\n", NIPQUAD(sk->daddr));
+    __tcpha_fe_conn_destroy(conn->herder, conn);
+}
@@ -10,18 +10,7 @@
 #define CONNECTION_FINISHED 4
 #define CONNECTION_ALIVE 8
 
-/** 
- * Work, and events to process, this may be refactored 
- * if it becomes a performance issue so we are not allocing 
- * and deallocing these constantly. 
- * @author rfliam200 (5/27/2011)
- */
-struct event_process {
-	struct tcpha_fe_conn *conn;
-    struct tcpha_fe_herder *herder;
-	unsigned int events;
-	struct work_struct work;
-};
+struct tcpha_fe_conn;
 
 /**
  * Sets up a set of processors to work on incoming 
@@ -41,24 +30,19 @@ void processor_destroy(struct workqueue_struct *processor);
  * 
  * @author rfliam200 (5/27/2011)
  * 
- * @param data An event_process struct, used for when we queue up work from the connection 
- * herders. (Note we may want to change event_process eventually so that we are not alloc 
- * and deallocing constantly doing this). 
+ * @param data The tcpha_fe_conn whose work this is. The events to process are 
+ * taken from its pending_events, and the reference the work held is dropped. 
  */
 void process_connection(void * data);
 
 /**
- * Create an event process.
- * 
- * @author rfliam200 (5/27/2011)
- */
-void event_process_alloc(struct event_process**);
-
-/**
- * Free an event process item.
+ * Process the events pending on a connection, unless someone else 
+ * already is (they will pick up anything pending before they 
+ * stop). This is what the processor runs, and what a herder 
+ * calls directly when it runs to completion. 
  * 
- * @author rfliam200 (5/27/2011)
+ * @param conn The connection, the caller must hold a reference.
  */
-void event_process_free(struct event_process*);
+void process_connection_events(struct tcpha_fe_conn *conn);
 
 #endif
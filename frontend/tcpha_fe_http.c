@@ -15,10 +15,16 @@ void http_init(void)
 		printk(KERN_ALERT "Error getting http_header memcache\n");*/
 }
 
-struct http_header *http_header_alloc(void)
+struct http_header *http_header_alloc(int node)
 {
+	struct http_header *hdr;
+
 	/*return kmem_cache_zalloc(header_cache_ptr, GFP_KERNEL);*/
-	return kzalloc(sizeof(struct http_header), GFP_KERNEL);
+	hdr = kmalloc_node(sizeof(struct http_header), GFP_KERNEL, node);
+	if (hdr)
+		memset(hdr, 0, sizeof(struct http_header));
+	tcpha_fe_count_node_alloc(hdr, node);
+	return hdr;
 }
 void http_header_free(struct http_header *hdr)
 {
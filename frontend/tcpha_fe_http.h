@@ -28,7 +28,7 @@ struct http_header {
 void http_init(void);
 void http_destroy(void);
 /* Use this method to get a header to work with */
-struct http_header *http_header_alloc(void);
+struct http_header *http_header_alloc(int node);
 void http_header_free(struct http_header *hdr);
 
 
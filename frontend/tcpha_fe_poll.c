@@ -1,13 +1,21 @@
 #include "tcpha_fe_poll.h"
 #include "tcpha_fe_utils.h"
+#include <linux/moduleparam.h>
+#include <linux/delay.h>
+#include <linux/vmalloc.h>
+#include <linux/random.h>
+#include <linux/tcp.h>
+#include <linux/kthread.h>
 
 /* Developer Notes:
  *  The structure lock in tcp_eventpoll "lock" is used to protect against concurrent
- *  modification of the epoll. The other two locks are to protect against the fact that
- *  we modify the eventpoll (wake, etc.) in an interrupt context. In particular the
- *  ready list lock list_lock and the epoll item lock "lock". We use the irq variants
- *  of the spinlocks as they disable interrupts during there operation. Hold them for
- *  as short a time as possible!.
+ *  modification of the hash. Nothing else takes it: lookups (see tcp_ep_hash_find),
+ *  wakeups and collecting all rely on items being freed only after a grace period,
+ *  see tcp_ep_item_retire.
+ *  The epoll item lock "lock" protects against the fact that we modify items (wake,
+ *  etc.) in an interrupt context, so we use the irq variants. Hold it for as short
+ *  a time as possible!. The ready list takes no lock to add to, see
+ *  add_item_to_readylist and tcp_epoll_collect for how an item moves through it.
  */
  /* This will be woken up when we recieve acks too...  may need to redirect-acks from here?
     Alternative is netfilter but than I need to do lookups to find sockets from a global pool. */
@@ -15,26 +23,75 @@
 struct kmem_cache *tcp_ep_item_cachep = NULL;
 atomic_t item_cache_use = ATOMIC_INIT(0);
 
+/* Longest a poller spins on an empty ready list before sleeping */
+int tcphafe_busy_poll_us = 0;
+module_param(tcphafe_busy_poll_us, int, 0644);
+MODULE_PARM_DESC(tcphafe_busy_poll_us, "Most microseconds to busy poll an empty ready list before sleeping, 0 is off (default 0)");
+
+/* How new items hear about their socket, see tcp_ep_item_hook */
+int tcphafe_poll_callbacks = 0;
+module_param(tcphafe_poll_callbacks, int, 0644);
+MODULE_PARM_DESC(tcphafe_poll_callbacks, "Hook the socket callbacks of new connections instead of sleeping on their wait queue (default 0)");
+
+/* A connections 4-tuple, what the hash is keyed on */
+struct tcp_ep_key {
+    __be32 daddr;
+    __be32 saddr;
+    __be16 dport;
+    __be16 sport;
+};
+
+/* Buckets of items, replaced wholesale when resized */
+struct tcp_ep_hash {
+    unsigned int size; /* Always a power of 2 */
+    int vmalloced;
+    /* Once replaced, freed after lookups in it are done */
+    struct rcu_head rcu;
+    struct tcp_ep_hash *reap_next;
+    struct hlist_head buckets[0];
+};
+
+/* Bits in tcp_ep_item rd_state, only ever changed with cmpxchg */
+#define TCP_EP_RD_QUEUED 1 /* Pushed and not yet collected */
+#define TCP_EP_RD_DISARMED 2 /* One shot item collected and not yet re-armed */
+#define TCP_EP_RD_DEAD 4 /* Destroyed, whoever clears QUEUED retires it */
+
+/* Dead items are freed this many at a time, a grace period per batch.
+ * They hold their connections sockets open, so a part batch isn't kept
+ * waiting longer than TCP_EP_FREE_DELAY jiffies either. */
+#define TCP_EP_FREE_BATCH 32
+#define TCP_EP_FREE_DELAY (HZ / 20)
+
 /* Every socket we are epolling gets one of these linked in to the hash */
 struct tcp_ep_item {
     /* Structure Lock, should be got with an IRQ lock
-     * when modifying event_flags and rd_list_link. */
+     * when modifying event_flags and rcv_nxt. */
     rwlock_t lock;
 
     /* The sock this represents */
     struct socket *sock;
 
-    /* Tie us into the RB-Tree hash */
-    struct rb_node hash_node;
+    /* Tie us into the hash, by our sockets 4-tuple */
+    struct hlist_node hash_node;
+    struct tcp_ep_key key;
+
+    /* Lookups may still be looking at us after we are removed. The
+     * first item of a batch being freed carries the batch. */
+    struct rcu_head rcu;
 
     /* Used to tie this into the ready list */
-    struct list_head rd_list;
+    struct tcp_ep_item *rd_next; /* On the pushed stack, or once dead a free batch */
+    struct list_head rd_list; /* On the collectors list */
+    unsigned long rd_since; /* jiffies when it went on the ready list */
+    atomic_t rd_state; /* TCP_EP_RD_* */
 
     /* Int  describing the events we are interested in */
     unsigned int event_flags;
+    u32 rcv_nxt; /* For ET, how far the data we have reported goes */
 
-    /* The events that have occured on this socket */
-    unsigned int events;
+    /* The events that have occured on this socket, OR'ed in before
+     * the item is pushed and taken by the collector */
+    atomic_t events;
 
     /* The eventpoll this item is tied too */
     struct tcp_eventpoll *eventpoll;
@@ -42,57 +99,124 @@ struct tcp_ep_item {
     /* Our wait queue */
     wait_queue_t wait;
 
-    /* Wait queue head we are linked to */
+    /* Wait queue head we are linked to, NULL if we hooked the socket */
     wait_queue_head_t *whead;
 
+    /* The sockets own callbacks while we have them hooked */
+    void (*saved_data_ready)(struct sock *sk, int bytes);
+    void (*saved_state_change)(struct sock *sk);
+    void (*saved_write_space)(struct sock *sk);
+
+    /* We hold a reference, let go of once we are freed */
     struct tcpha_fe_conn *conn;
 };
 
+/* Batches of items whose grace period is over. Letting go of a connection
+ * can release its socket, so they are freed from keventd. So are old
+ * hashes that were vmalloced, vfree can't be called from softirq. */
+static struct tcp_ep_item *tcp_ep_reap_head = NULL;
+static struct tcp_ep_hash *tcp_ep_reap_hashes = NULL;
+static DEFINE_SPINLOCK(tcp_ep_reap_lock);
+static void tcp_ep_reap(void *data);
+static DECLARE_WORK(tcp_ep_reap_work, tcp_ep_reap, NULL);
+
 /* Private Method Prototypes */
 /*---------------------------------------------------------------------------*/
 /* Constructor/destructors for our structs */
-static int tcp_ep_item_alloc(struct tcp_ep_item **item);
+static int tcp_ep_item_alloc(struct tcp_ep_item **item, int node);
 static void tcp_ep_item_destroy(struct tcp_ep_item *item);
 static inline void tcp_ep_item_free(struct tcp_ep_item *item);
+static void tcp_ep_item_retire(struct tcp_ep_item *item);
+static void tcp_ep_free_flush(struct tcp_eventpoll *ep);
+static void tcp_ep_free_rcu(struct rcu_head *head);
 
-static inline int tcp_epoll_alloc(struct tcp_eventpoll **eventpoll);
+static inline int tcp_epoll_alloc(struct tcp_eventpoll **eventpoll, int node);
 static inline void tcp_epoll_free(struct tcp_eventpoll *eventpoll);
 
 /* Utility methods */
 /* Called by the socket wakequeue when actvitiy occurs on it, determines if 
  * we should wake any sleepers and add item to readylist */
 static int tcp_epoll_wakeup(wait_queue_t *curr, unsigned mode, int sync, void *key);
+static void tcp_epoll_item_wake(struct tcp_ep_item *item, unsigned int key);
+static int tcp_ep_item_hook(struct tcp_ep_item *item);
+static void tcp_ep_item_unhook(struct tcp_ep_item *item);
+static void tcp_ep_data_ready(struct sock *sk, int bytes);
+static void tcp_ep_state_change(struct sock *sk);
+static void tcp_ep_write_space(struct sock *sk);
 static inline unsigned int tcp_epoll_check_events(struct tcp_ep_item *item);
+static unsigned int tcp_epoll_item_events(struct tcp_ep_item *item, unsigned int key);
 static inline struct tcp_ep_item *tcp_ep_item_from_wait(wait_queue_t *p);
-static inline void add_item_to_readylist(struct tcp_ep_item *item);
-static inline void remove_item_from_readylist(struct tcp_ep_item *item);
-
-/* RBTree (hash) Usage Methods */
+static inline void tcp_epoll_wake_poller(struct tcp_eventpoll *ep);
+static long tcp_epoll_sleep(struct tcp_eventpoll *ep, long timeout);
+static int tcp_epoll_busy_poll(struct tcp_eventpoll *ep);
+static int tcp_epoll_collect(struct tcp_eventpoll *ep, struct tcpha_fe_conn **conns, int maxevents, int from_tail);
+static inline void tcp_epoll_note_delay(struct tcp_eventpoll *ep, unsigned long delay);
+static inline int add_item_to_readylist(struct tcp_ep_item *item);
+static inline void tcp_ep_item_add_events(struct tcp_ep_item *item, unsigned int events);
+static inline void tcp_ep_rd_clear(struct tcp_ep_item *item, int bits);
+static inline int tcp_ep_rd_consume(struct tcp_ep_item *item);
+static void tcp_ep_rd_splice(struct tcp_eventpoll *ep);
+
+/* Hash Usage Methods */
 static int tcp_ep_hash_insert(struct tcp_ep_item *item);
+static void tcp_ep_hash_remove(struct tcp_ep_item *item);
 static struct tcp_ep_item *tcp_ep_hash_find(struct tcp_eventpoll *eventpoll, struct socket *sock);
+static void tcp_ep_hash_resize(struct tcp_eventpoll *ep);
 
-static inline void tcp_ep_rb_initnode(struct rb_node *n);
-static inline void tcp_ep_rb_removenode(struct rb_node *n, struct rb_root *r);
-static inline int tcp_cmp_sock(struct socket *leftsock, struct socket *rightsock);
+static struct tcp_ep_hash *tcp_ep_hash_alloc(unsigned int size, int node);
+static void tcp_ep_hash_free(struct tcp_ep_hash *hash);
+static void tcp_ep_hash_free_rcu(struct rcu_head *head);
+static inline void tcp_ep_key_from_sock(struct tcp_ep_key *key, struct socket *sock);
+static inline int tcp_ep_key_equal(const struct tcp_ep_key *a, const struct tcp_ep_key *b);
+static inline unsigned int tcp_ep_key_hash(struct tcp_eventpoll *ep, const struct tcp_ep_key *key);
 
 /* Constructor/Destructor methods */
 /*---------------------------------------------------------------------------*/
-int tcp_epoll_init(struct tcp_eventpoll **eventpoll)
+int tcp_epoll_init(struct tcp_eventpoll **eventpoll, int node)
 {
     int err;
     struct tcp_eventpoll *ep;
 
-    err = tcp_epoll_alloc(eventpoll);
+    err = tcp_epoll_alloc(eventpoll, node);
     if (err)
         return err;
 
     ep = *eventpoll;
-    init_waitqueue_head(&ep->poll_wait);
+    ep->poller = NULL;
+    atomic_set(&ep->sleeping, 0);
+    clear_bit(0, &ep->kicked);
+    ep->rd_head = NULL;
     INIT_LIST_HEAD(&ep->ready_list);
+    spin_lock_init(&ep->consume_lock);
+    atomic_set(&ep->ready_len, 0);
     rwlock_init(&ep->lock);
-    rwlock_init(&ep->list_lock);
-    ep->hash_root = RB_ROOT;
-    clear_bit(0, &ep->should_wake);
+    ep->dead_head = NULL;
+    atomic_set(&ep->dead_count, 0);
+    ep->dead_since = jiffies;
+    ep->hash = tcp_ep_hash_alloc(TCP_EP_HASH_MIN, node);
+    if (!ep->hash) {
+        tcp_epoll_free(ep);
+        *eventpoll = NULL;
+        return -ENOMEM;
+    }
+    seqcount_init(&ep->hash_seq);
+    ep->hash_count = 0;
+    get_random_bytes(&ep->hash_rnd, sizeof(ep->hash_rnd));
+    ep->cpu = -1;
+    ep->node = node;
+    atomic_set(&ep->stat_wakeups, 0);
+    atomic_set(&ep->stat_remote_wakeups, 0);
+    atomic_set(&ep->stat_wakeups_ignored, 0);
+    atomic_set(&ep->stat_push_retries, 0);
+    atomic_set(&ep->stat_polls, 0);
+    atomic_set(&ep->stat_poller_wakeups, 0);
+    atomic_set(&ep->stat_freed, 0);
+    atomic_set(&ep->stat_free_batches, 0);
+    ep->busy_poll_us = tcphafe_busy_poll_us;
+    ep->stat_spin_hits = 0;
+    ep->stat_spin_misses = 0;
+    ep->stat_max_delay = 0;
+    memset(ep->stat_delay, 0, sizeof(ep->stat_delay));
 
     /* Guard against multiple initilization, make it for the first user */
     if (atomic_inc_return(&item_cache_use) == 1) {
@@ -105,12 +229,14 @@ int tcp_epoll_init(struct tcp_eventpoll **eventpoll)
     return 0;
 }
 
-static inline int tcp_epoll_alloc(struct tcp_eventpoll **eventpoll)
+static inline int tcp_epoll_alloc(struct tcp_eventpoll **eventpoll, int node)
 {
-    struct tcp_eventpoll *ep = kzalloc(sizeof(struct tcp_eventpoll), GFP_KERNEL);
+    struct tcp_eventpoll *ep = kmalloc_node(sizeof(struct tcp_eventpoll), GFP_KERNEL, node);
 
     if (!ep)
         return -ENOMEM;
+    memset(ep, 0, sizeof(struct tcp_eventpoll));
+    tcpha_fe_count_node_alloc(ep, node);
 
     *eventpoll = ep;
     return 0;
@@ -118,14 +244,35 @@ static inline int tcp_epoll_alloc(struct tcp_eventpoll **eventpoll)
 
 void tcp_epoll_destroy(struct tcp_eventpoll *ep)
 {
-    struct rb_node *node;
+    struct tcp_ep_item *item;
+    struct hlist_node *pos, *next;
+    unsigned int i;
+
     /* Cleanup epoll items in the hash */
-    for (node = rb_first(&ep->hash_root); node; node = rb_next(node))
-        tcp_ep_item_destroy(rb_entry(node, struct tcp_ep_item, hash_node)); ;
+    for (i = 0; i < ep->hash->size; i++)
+        hlist_for_each_entry_safe(item, pos, next, &ep->hash->buckets[i], hash_node)
+            tcp_ep_item_destroy(item);
+
+    /* Anything still queued is dead now, collecting retires it */
+    spin_lock(&ep->consume_lock);
+    tcp_ep_rd_splice(ep);
+    while (!list_empty(&ep->ready_list)) {
+        item = list_entry(ep->ready_list.next, struct tcp_ep_item, rd_list);
+        list_del_init(&item->rd_list);
+        if (!tcp_ep_rd_consume(item))
+            tcp_ep_item_retire(item);
+    }
+    spin_unlock(&ep->consume_lock);
+    /* Batches no longer need us once started */
+    tcp_ep_free_flush(ep);
 
+    /* No one can be looking anymore */
+    tcp_ep_hash_free(ep->hash);
     tcp_epoll_free(ep);
-    /* Destroy for the last user */
+    /* Destroy for the last user, once the items have all been freed */
     if (atomic_dec_and_test(&item_cache_use)) {
+        rcu_barrier();
+        flush_scheduled_work();
         kmem_cache_destroy(tcp_ep_item_cachep);
     }
 }
@@ -136,24 +283,31 @@ static inline void tcp_epoll_free(struct tcp_eventpoll *eventpoll)
         kfree(eventpoll);
 }
 
-static int tcp_ep_item_alloc(struct tcp_ep_item **item)
+static int tcp_ep_item_alloc(struct tcp_ep_item **item, int node)
 {
     struct tcp_ep_item *epi;
 
     if (!tcp_ep_item_cachep)
         return -1;
 
-    epi = kmem_cache_alloc(tcp_ep_item_cachep, SLAB_KERNEL);
+    epi = kmem_cache_alloc_node(tcp_ep_item_cachep, SLAB_KERNEL, node);
 
     if (!epi)
         return -ENOMEM;
+    tcpha_fe_count_node_alloc(epi, node);
 
     rwlock_init(&epi->lock);
-    tcp_ep_rb_initnode(&epi->hash_node);
+    INIT_HLIST_NODE(&epi->hash_node);
     INIT_LIST_HEAD(&epi->rd_list);
+    epi->rd_next = NULL;
+    atomic_set(&epi->rd_state, 0);
     epi->event_flags = 0;
-    epi->events = 0;
+    epi->rcv_nxt = 0;
+    atomic_set(&epi->events, 0);
     epi->whead = NULL;
+    epi->saved_data_ready = NULL;
+    epi->saved_state_change = NULL;
+    epi->saved_write_space = NULL;
     *item = epi;
     return 0;
 }
@@ -162,26 +316,120 @@ static void tcp_ep_item_destroy(struct tcp_ep_item *item)
 {
     struct tcp_eventpoll *ep = item->eventpoll;
     unsigned long flags;
-    /* Delete the item from the hash and readylist */
-    write_lock(&ep->lock);
-
-    /* Now remove ourseleves from any poll stuff */
+    int old;
+    /* Now remove ourseleves from any poll stuff, once we are off no
+     * wakeup can be running on us */
     /* We let go of the lock quickly since no one else should now cause
      * concurrent modification to the item and we want irqs back on quickly*/
-    if (item && item->whead) {
+    if (item->whead) {
         write_lock_irqsave(&item->lock, flags);
         remove_wait_queue(item->whead, &item->wait);
         write_unlock_irqrestore(&item->lock, flags);
-    }    
+    } else {
+        tcp_ep_item_unhook(item);
+    }
 
-    tcp_ep_rb_removenode(&item->hash_node, &ep->hash_root);
+    /* Delete the item from the hash, the only thing that needs the lock */
+    write_lock(&ep->lock);
+    tcp_ep_hash_remove(item);
+    if (item->conn->ep_item == item) {
+        item->conn->ep_item = NULL;
+        item->conn->eventpoll = NULL;
+    }
     write_unlock(&ep->lock);
 
-    /* Locks for us */
-    remove_item_from_readylist(item); 
+    /* No wakeups can reach us now, mark us dead so we never get pushed
+     * again. If we are already pushed the collector retires us. Anyone
+     * collecting us right now saw us alive, they do so under
+     * rcu_read_lock so retiring waits them out without a lock. */
+    do {
+        old = atomic_read(&item->rd_state);
+    } while (atomic_cmpxchg(&item->rd_state, old, old | TCP_EP_RD_DEAD) != old);
+
+    if (!(old & TCP_EP_RD_QUEUED))
+        tcp_ep_item_retire(item);
+}
+
+/*
+ * Free a dead item, and drop its connection, once nothing can be looking
+ * at it. Items are put aside until there are TCP_EP_FREE_BATCH of them
+ * (or the poller goes idle, or the oldest has waited TCP_EP_FREE_DELAY)
+ * so a whole batch shares one grace period.
+ */
+static void tcp_ep_item_retire(struct tcp_ep_item *item)
+{
+    struct tcp_eventpoll *ep = item->eventpoll;
+    struct tcp_ep_item *first;
+    int count;
+
+    do {
+        first = ep->dead_head;
+        item->rd_next = first;
+    } while (cmpxchg(&ep->dead_head, first, item) != first);
+
+    count = atomic_inc_return(&ep->dead_count);
+    if (count == 1)
+        ep->dead_since = jiffies;
+    else if (count >= TCP_EP_FREE_BATCH)
+        tcp_ep_free_flush(ep);
+}
+
+/* Start a grace period for everything retired so far */
+static void tcp_ep_free_flush(struct tcp_eventpoll *ep)
+{
+    struct tcp_ep_item *batch, *item;
+    int count = 0;
+
+    batch = xchg(&ep->dead_head, NULL);
+    if (!batch)
+        return;
+    for (item = batch; item; item = item->rd_next)
+        count++;
+    atomic_sub(count, &ep->dead_count);
+    atomic_add(count, &ep->stat_freed);
+    atomic_inc(&ep->stat_free_batches);
 
-    /* Delete the item */
-    tcp_ep_item_free(item);
+    call_rcu(&batch->rcu, tcp_ep_free_rcu);
+}
+
+/* A batches grace period is over, hand it to keventd */
+static void tcp_ep_free_rcu(struct rcu_head *head)
+{
+    struct tcp_ep_item *batch = container_of(head, struct tcp_ep_item, rcu);
+    struct tcp_ep_item *last;
+
+    for (last = batch; last->rd_next; last = last->rd_next)
+        ;
+    spin_lock(&tcp_ep_reap_lock);
+    last->rd_next = tcp_ep_reap_head;
+    tcp_ep_reap_head = batch;
+    spin_unlock(&tcp_ep_reap_lock);
+
+    schedule_work(&tcp_ep_reap_work);
+}
+
+/* Free every batch whose grace period is over */
+static void tcp_ep_reap(void *data)
+{
+    struct tcp_ep_item *item, *next;
+    struct tcp_ep_hash *hash, *next_hash;
+
+    spin_lock_bh(&tcp_ep_reap_lock);
+    item = tcp_ep_reap_head;
+    tcp_ep_reap_head = NULL;
+    hash = tcp_ep_reap_hashes;
+    tcp_ep_reap_hashes = NULL;
+    spin_unlock_bh(&tcp_ep_reap_lock);
+
+    for (; item; item = next) {
+        next = item->rd_next;
+        tcpha_fe_conn_put(item->conn);
+        tcp_ep_item_free(item);
+    }
+    for (; hash; hash = next_hash) {
+        next_hash = hash->reap_next;
+        tcp_ep_hash_free(hash);
+    }
 }
 
 static inline void tcp_ep_item_free(struct tcp_ep_item *item)
@@ -194,132 +442,396 @@ static inline void tcp_ep_item_free(struct tcp_ep_item *item)
 /*---------------------------------------------------------------------------*/
 int tcp_epoll_insert(struct tcp_eventpoll *eventpoll, struct tcpha_fe_conn *conn, unsigned int flags)
 {
-    int err;
-    unsigned int mask;
-    unsigned long irqflags;
-    struct tcp_ep_item *item = NULL;
-    struct socket *sock = conn->csock;
+    int err = tcp_epoll_insert_batch(eventpoll, &conn, 1, flags);
 
-    /* Allocate our item */
-    err = tcp_ep_item_alloc(&item);
-    if (unlikely(err))
+    if (err < 0)
         return err;
+    /* Not inserted, it was already there */
+    return err ? 0 : -EEXIST;
+}
 
-    /* Setup our item, no need to lock because no one else could POSSIBLY
-     * have it yet. */
-    item->sock = sock;
-    item->event_flags = flags | POLLERR | POLLHUP | POLLRDHUP;
-    item->eventpoll = eventpoll;
-    item->conn = conn;
-
-    /* And set it up to add itself to the readylist when appropriate */
-    init_waitqueue_func_entry(&item->wait, tcp_epoll_wakeup);
-    item->whead = sock->sk->sk_sleep;
+/* Insert a group of connections taking the epoll lock only once. Returns
+ * the number of connections inserted or less than 0 on error. Those that
+ * were inserted have their eventpoll set, the rest are left alone. */
+int tcp_epoll_insert_batch(struct tcp_eventpoll *eventpoll, struct tcpha_fe_conn *conns[], int nconns, unsigned int flags)
+{
+    int err = 0;
+    int i, inserted = 0, ready = 0;
+    unsigned int mask;
+    unsigned long irqflags;
+    struct tcp_ep_item *items[TCPHA_CONN_BATCH];
+    struct tcp_ep_item *item;
 
-    /* If its already ready stitch it into the ready list */
-    mask = tcp_epoll_check_events(item);
-    if (mask)
-        add_item_to_readylist(item); /* Locks for us */
+    if (nconns > TCPHA_CONN_BATCH)
+        return -EINVAL;
+
+    /* Allocate all our items before we take any locks */
+    for (i = 0; i < nconns; i++) {
+        err = tcp_ep_item_alloc(&items[i], eventpoll->node);
+        if (unlikely(err))
+            goto alloc_fail;
+
+        /* Setup our item, no need to lock because no one else could POSSIBLY
+         * have it yet. */
+        item = items[i];
+        item->sock = conns[i]->csock;
+        tcp_ep_key_from_sock(&item->key, item->sock);
+        item->event_flags = flags | POLLERR | POLLHUP | POLLRDHUP;
+        /* Anything not yet read counts as new */
+        item->rcv_nxt = tcp_sk(item->sock->sk)->copied_seq;
+        item->eventpoll = eventpoll;
+        item->conn = conns[i];
+
+        /* And set it up to add itself to the readylist when appropriate,
+         * from the wait queue unless we will hook the socket instead */
+        init_waitqueue_func_entry(&item->wait, tcp_epoll_wakeup);
+        if (!tcphafe_poll_callbacks)
+            item->whead = item->sock->sk->sk_sleep;
+    }
 
-    /* Add it to the hash*/
+    /* Add them to the hash and hook them up in one go */
     write_lock(&eventpoll->lock);
-    err = tcp_ep_hash_insert(item);
-
-    /* Hold the lock as short as time as possible! */
-    write_lock_irqsave(&item->lock, irqflags);
-    add_wait_queue(item->whead, &item->wait);
-    write_unlock_irqrestore(&item->lock, irqflags);
+    for (i = 0; i < nconns; i++) {
+        item = items[i];
+        if (tcp_ep_hash_insert(item)) {
+            /* May occur if the socket is already in the epoll */
+            printk(KERN_ALERT "Error adding item in tcp insert");
+            tcp_ep_item_free(item);
+            items[i] = NULL;
+            continue;
+        }
+        /* We hold the connection until we are freed */
+        tcpha_fe_conn_get(conns[i]);
+        /* Let the connection find us without a lookup */
+        conns[i]->ep_item = item;
+        conns[i]->eventpoll = eventpoll;
+
+        /* Someone else has the callbacks, wait on the queue after all */
+        if (!item->whead && tcp_ep_item_hook(item))
+            item->whead = item->sock->sk->sk_sleep;
+
+        if (item->whead) {
+            /* Hold the lock as short as time as possible! */
+            write_lock_irqsave(&item->lock, irqflags);
+            add_wait_queue(item->whead, &item->wait);
+            write_unlock_irqrestore(&item->lock, irqflags);
+        }
+        inserted++;
+    }
     write_unlock(&eventpoll->lock);
 
-    if (err)
-        goto insert_fail;
+    /* Now that we are hooked nothing can be missed, stitch anything
+     * that is already ready into the ready list */
+    for (i = 0; i < nconns; i++) {
+        item = items[i];
+        if (!item)
+            continue;
+
+        write_lock_irqsave(&item->lock, irqflags);
+        mask = tcp_epoll_item_events(item, 0);
+        if (mask) {
+            tcp_ep_item_add_events(item, mask);
+            ready += add_item_to_readylist(item);
+        }
+        write_unlock_irqrestore(&item->lock, irqflags);
+    }
 
-    return 0;
+    /* Nothing else will wake the poller for events that beat the hook */
+    if (ready)
+        tcp_epoll_wake_poller(eventpoll);
+
+    /* Keep chains short as we grow */
+    if (eventpoll->hash_count > eventpoll->hash->size * 2)
+        tcp_ep_hash_resize(eventpoll);
+
+    return inserted;
 
-    /* May occur if the ep goes away while we are trying to insert
-     * an item. */
-    insert_fail:
-    printk(KERN_ALERT "Error adding item in tcp insert");
-    tcp_ep_item_free(item);
+    alloc_fail:
+    while (--i >= 0)
+        tcp_ep_item_free(items[i]);
     return err;
 }
 
+/* The connections item in this epoll, straight from the connection
+ * when it is ours, otherwise from the hash */
+static inline struct tcp_ep_item *tcp_epoll_conn_item(struct tcp_eventpoll *ep, struct tcpha_fe_conn *conn)
+{
+    if (conn->ep_item && conn->eventpoll == ep)
+        return conn->ep_item;
+    return tcp_ep_hash_find(ep, conn->csock);
+}
+
 /* Remove the item from all relevant structs etc */
 void tcp_epoll_remove(struct tcp_eventpoll *ep, struct tcpha_fe_conn *conn)
 {
     struct tcp_ep_item *item;
-    struct socket *sock = conn->csock;
 
-    /* First find the item for the struct in our RB Tree */
-    read_lock(&ep->lock);
-    item = tcp_ep_hash_find(ep, sock);
-    read_unlock(&ep->lock);
+    item = tcp_epoll_conn_item(ep, conn);
     if (!item)
         return;
 
+    tcp_epoll_item_remove(item);
+}
+
+void tcp_epoll_item_remove(struct tcp_ep_item *item)
+{
+    struct tcp_eventpoll *ep = item->eventpoll;
+
     tcp_ep_item_destroy(item);  
+
+    /* Give back memory after mass disconnects */
+    if (ep->hash_count < ep->hash->size / 8 && ep->hash->size > TCP_EP_HASH_MIN)
+        tcp_ep_hash_resize(ep);
 }
 
 int tcp_epoll_setflags(struct tcp_eventpoll *ep, struct tcpha_fe_conn *conn, unsigned int flags)
 {
-    unsigned long irqflags;
     struct tcp_ep_item *item;
 
-    read_lock(&ep->lock);
-    item = tcp_ep_hash_find(ep, conn->csock);
-    read_unlock(&ep->lock);
+    item = tcp_epoll_conn_item(ep, conn);
     if (!item)
         return -1;
 
+    return tcp_epoll_item_setflags(item, flags);
+}
+
+/*
+ * Change what an item reports. This is also how a one shot item is
+ * re-armed, anything that arrived while it was disarmed is picked up
+ * here (for ET, anything not yet read).
+ */
+int tcp_epoll_item_setflags(struct tcp_ep_item *item, unsigned int flags)
+{
+    unsigned long irqflags;
+    unsigned int mask;
+    int ready = 0;
+
+    /* Errors and hangups are always reported, as on insert */
     write_lock_irqsave(&item->lock, irqflags);
-    item->event_flags = flags;
+    item->event_flags = flags | POLLERR | POLLHUP | POLLRDHUP;
+    item->rcv_nxt = tcp_sk(item->sock->sk)->copied_seq;
+    tcp_ep_rd_clear(item, TCP_EP_RD_DISARMED);
+    mask = tcp_epoll_item_events(item, 0);
+    if (mask) {
+        tcp_ep_item_add_events(item, mask);
+        ready = add_item_to_readylist(item);
+    }
     write_unlock_irqrestore(&item->lock, irqflags);
-    /* Find the item, and change its flags */
+
+    if (ready)
+        tcp_epoll_wake_poller(item->eventpoll);
     return 0;
 }
 
 /* Collects our events */
-int tcp_epoll_wait(struct tcp_eventpoll *ep, struct tcpha_fe_conn **conns, int maxevents)
+int tcp_epoll_wait(struct tcp_eventpoll *ep, struct tcpha_fe_conn **conns, int maxevents, long timeout)
 {
-    struct tcp_ep_item *item, *next;
-    unsigned long flags;
-    int events = 0;
-
-    /* Wait till we have items in the ready_list (or we should quit) */
-    if (list_empty(&ep->ready_list)) {
-          printk(KERN_ALERT "Sleeping...zzzz\n");
-        /* Only sleeps if the second arguments evaluates to _false_ */
-          wait_event_interruptible(ep->poll_wait, test_bit(0, &ep->should_wake) );
-          clear_bit(0, &ep->should_wake);
-          printk(KERN_ALERT "Woke! \n");
-    }
+    /* A busy poller never goes idle, don't leave the dead holding
+     * their sockets open for long */
+    if (atomic_read(&ep->dead_count) &&
+        time_after_eq(jiffies, ep->dead_since + TCP_EP_FREE_DELAY))
+        tcp_ep_free_flush(ep);
+
+    /* Wait till we have items in the ready_list (or we should quit, or
+     * the time is up), spinning a little first if that has been paying off */
+    if (timeout > 0 && !tcp_epoll_backlog(ep) && !tcp_epoll_busy_poll(ep))
+        tcp_epoll_sleep(ep, timeout);
+    clear_bit(0, &ep->kicked);
 
     /* If something else woke us up... */
-    if (list_empty(&ep->ready_list))
+    if (!tcp_epoll_backlog(ep))
           return 0;
 
     printk(KERN_ALERT "  Items in ready list\n");
+    return tcp_epoll_collect(ep, conns, maxevents, 0);
+}
+
+int tcp_epoll_wait_until(struct tcp_eventpoll *ep, struct tcpha_fe_conn **conns, int maxevents, unsigned long deadline)
+{
+    long timeout = (long)(deadline - jiffies);
+
+    return tcp_epoll_wait(ep, conns, maxevents, timeout > 0 ? timeout : 0);
+}
+
+/* Take ready items from another herders epoll */
+int tcp_epoll_steal(struct tcp_eventpoll *ep, struct tcpha_fe_conn **conns, int maxevents)
+{
+    if (!tcp_epoll_backlog(ep))
+        return 0;
+
+    /* Take from the end the owner will get to last */
+    return tcp_epoll_collect(ep, conns, maxevents, 1);
+}
+
+/* Wake the poller even though nothing is ready for it */
+void tcp_epoll_kick(struct tcp_eventpoll *ep)
+{
+    set_bit(0, &ep->kicked);
+    tcp_epoll_wake_poller(ep);
+}
+
+/* Private Other Methods */
+/*---------------------------------------------------------------------------*/
 
-    /* Now lock the ready list and grab all the items in it and remove them. */
-    /* We disable IRQ's so we don't need to worry about modification of the items under us */
-    write_lock_irqsave(&ep->list_lock, flags);
-    list_for_each_entry_safe(item, next, &ep->ready_list, rd_list) {
-        if (events < maxevents) {
-            conns[events] = item->conn;
-            conns[events]->events = item->events;
-            item->events = 0;
-            list_del_init(&item->rd_list);
-            events++;
-        } else {
+/*
+ * Spin on an empty ready list for up to the eventpolls current budget.
+ * The budget doubles (up to tcphafe_busy_poll_us) each time the spin
+ * finds work and halves each time it doesn't, so a poller that is rarely
+ * rewarded spends next to nothing before sleeping.
+ * Returns 1 if something became ready.
+ */
+static int tcp_epoll_busy_poll(struct tcp_eventpoll *ep)
+{
+    int limit = tcphafe_busy_poll_us;
+    int budget = ep->busy_poll_us;
+    int spun;
+
+    if (limit <= 0)
+        return 0;
+    if (budget > limit || budget < 1)
+        budget = limit;
+
+    for (spun = 0; spun < budget; spun++) {
+        if (tcp_epoll_backlog(ep)) {
+            ep->stat_spin_hits++;
+            ep->busy_poll_us = min(budget * 2, limit);
+            return 1;
+        }
+        /* Don't hold up someone who needs the cpu, or a stop */
+        if (need_resched() || test_bit(0, &ep->kicked) || kthread_should_stop())
             break;
+        cpu_relax();
+        udelay(1);
+    }
+
+    ep->stat_spin_misses++;
+    ep->busy_poll_us = max(budget / 2, 1);
+    return 0;
+}
+
+/* Bucket how long an item sat ready, must hold consume_lock */
+static inline void tcp_epoll_note_delay(struct tcp_eventpoll *ep, unsigned long delay)
+{
+    int bucket = fls(delay);
+
+    if (bucket >= TCP_EPOLL_DELAY_BUCKETS)
+        bucket = TCP_EPOLL_DELAY_BUCKETS - 1;
+    ep->stat_delay[bucket]++;
+    if (delay > ep->stat_max_delay)
+        ep->stat_max_delay = delay;
+}
+
+/*
+ * Pull up to maxevents items off the ready list, from the front or the back.
+ * Collectors (the poller and thieves) are serialized by consume_lock, which
+ * wakeups never take. Anything pushed since last time is moved over first.
+ */
+static int tcp_epoll_collect(struct tcp_eventpoll *ep, struct tcpha_fe_conn **conns, int maxevents, int from_tail)
+{
+    struct tcp_ep_item *item;
+    unsigned int mask;
+    int events = 0;
+
+    spin_lock(&ep->consume_lock);
+    rcu_read_lock();
+    tcp_ep_rd_splice(ep);
+    while (events < maxevents && !list_empty(&ep->ready_list)) {
+        if (from_tail)
+            item = list_entry(ep->ready_list.prev, struct tcp_ep_item, rd_list);
+        else
+            item = list_entry(ep->ready_list.next, struct tcp_ep_item, rd_list);
+
+        list_del_init(&item->rd_list);
+        atomic_dec(&ep->ready_len);
+        tcp_epoll_note_delay(ep, jiffies - item->rd_since);
+
+        /* Destroyed while it was queued, it is ours to retire and its
+         * connection is on its way out */
+        if (!tcp_ep_rd_consume(item)) {
+            tcp_ep_item_retire(item);
+            continue;
         }
+
+        /* Cleared after QUEUED, so events that race us either come
+         * with us now or push the item again */
+        mask = atomic_xchg(&item->events, 0);
+        /* Pushed again after the last collect took its events */
+        if (!mask)
+            continue;
+
+        conns[events] = item->conn;
+        /* It was alive when we took it, so even if it is destroyed now
+         * it can't be freed (and let go of the connection) until we
+         * leave the read side. The caller puts it when done. */
+        tcpha_fe_conn_get(conns[events]);
+        /* Whoever collects the item (us or a thief) hands its events
+         * straight to the connection, so nothing is shared after this */
+        tcpha_fe_conn_add_events(conns[events], mask);
+        events++;
     }
-    write_unlock_irqrestore(&ep->list_lock, flags);
+    rcu_read_unlock();
+    spin_unlock(&ep->consume_lock);
     return events;
 }
 
-/* Private Other Methods */
-/*---------------------------------------------------------------------------*/
+/*
+ * Take everything pushed on to the stack in one go and move it, oldest
+ * first, on to the end of ready_list. Must hold consume_lock.
+ */
+static void tcp_ep_rd_splice(struct tcp_eventpoll *ep)
+{
+    struct tcp_ep_item *item, *next;
+    LIST_HEAD(pushed);
+
+    if (!ep->rd_head)
+        return;
+
+    item = xchg(&ep->rd_head, NULL);
+    /* The stack is newest first, list_add reverses it */
+    while (item) {
+        next = item->rd_next;
+        list_add(&item->rd_list, &pushed);
+        item = next;
+    }
+    list_splice(&pushed, ep->ready_list.prev);
+}
+
+/*
+ * An item came off the ready list: no longer queued, and disarmed if
+ * it is one shot. Returns 0 if it was destroyed while queued.
+ */
+static inline int tcp_ep_rd_consume(struct tcp_ep_item *item)
+{
+    int old, new;
+
+    do {
+        old = atomic_read(&item->rd_state);
+        new = old & ~TCP_EP_RD_QUEUED;
+        if (item->event_flags & TCP_EPOLLONESHOT)
+            new |= TCP_EP_RD_DISARMED;
+    } while (atomic_cmpxchg(&item->rd_state, old, new) != old);
+
+    return !(old & TCP_EP_RD_DEAD);
+}
+
+static inline void tcp_ep_rd_clear(struct tcp_ep_item *item, int bits)
+{
+    int old;
+
+    do {
+        old = atomic_read(&item->rd_state);
+    } while (atomic_cmpxchg(&item->rd_state, old, old & ~bits) != old);
+}
+
+/* No atomic_or, so do it the hard way */
+static inline void tcp_ep_item_add_events(struct tcp_ep_item *item, unsigned int events)
+{
+    int old;
+
+    do {
+        old = atomic_read(&item->events);
+    } while (atomic_cmpxchg(&item->events, old, old | events) != old);
+}
 
 /* This method REQUIRES to hold the proper locks on item */
 static inline unsigned int tcp_epoll_check_events(struct tcp_ep_item *item)
@@ -330,135 +842,457 @@ static inline unsigned int tcp_epoll_check_events(struct tcp_ep_item *item)
     return item->event_flags & item->sock->ops->poll(NULL, item->sock, NULL);
 }
 
+/*
+ * The events an item should report right now, taking its mode in to
+ * account. For ET a wakeup with nothing new to read (an ACK, write
+ * space) reports nothing, errors and hangups always get through.
+ * key is the mask a wakeup came with, if it came with one, otherwise
+ * 0 and we poll the socket for it.
+ * This method REQUIRES to hold the proper locks on item.
+ */
+static unsigned int tcp_epoll_item_events(struct tcp_ep_item *item, unsigned int key)
+{
+    unsigned int mask;
+    u32 rcv_nxt;
+
+    if (atomic_read(&item->rd_state) & TCP_EP_RD_DISARMED)
+        return 0;
+
+    if (key) {
+        mask = item->event_flags & key;
+    } else {
+        atomic_inc(&item->eventpoll->stat_polls);
+        mask = tcp_epoll_check_events(item);
+    }
+    if (mask && (item->event_flags & TCP_EPOLLET) &&
+        !(mask & ~(POLLIN | POLLRDNORM))) {
+        rcv_nxt = tcp_sk(item->sock->sk)->rcv_nxt;
+        if (rcv_nxt == item->rcv_nxt)
+            return 0;
+        item->rcv_nxt = rcv_nxt;
+    }
+    return mask;
+}
+
 static int tcp_epoll_wakeup(wait_queue_t *curr, unsigned mode, int sync, void *key)
+{
+    /* Most wakers don't say what happened and we have to poll, but
+     * if one does that is all we need */
+    tcp_epoll_item_wake(tcp_ep_item_from_wait(curr), (unsigned long)key);
+    return 1;
+}
+
+/*
+ * Something happened on the items socket, key is what (if the waker
+ * knows, otherwise 0). Queue the item and wake the poller if it is
+ * something the item reports. Called in softirq, from either backend.
+ */
+static void tcp_epoll_item_wake(struct tcp_ep_item *item, unsigned int key)
 {
     unsigned int mask = 0;
-    struct tcp_ep_item *item;
     unsigned long flags;
 
-    item = tcp_ep_item_from_wait(curr);
-    printk(KERN_ALERT "Epoll Wakeup Called\n Locking\n");
+    atomic_inc(&item->eventpoll->stat_wakeups);
+    if (smp_processor_id() != item->eventpoll->cpu)
+        atomic_inc(&item->eventpoll->stat_remote_wakeups);
+    /* An item that isn't interested in the key doesn't even need its lock */
+    if (key && !(key & item->event_flags)) {
+        atomic_inc(&item->eventpoll->stat_wakeups_ignored);
+        return;
+    }
+
     write_lock_irqsave(&item->lock, flags);
-    printk(KERN_ALERT "    Item mask:\n");
-    printk(KERN_ALERT POLLMASKFMT, POLLMASK(item->sock->ops->poll(NULL, item->sock, NULL)));
-    mask = tcp_epoll_check_events(item);
+    mask = tcp_epoll_item_events(item, key);
 
     if (mask) {
-        printk(KERN_ALERT "    Mask Matches\n");
-        add_item_to_readylist(item);
-        item->events |= mask;
-        if (item && item->eventpoll && waitqueue_active(&item->eventpoll->poll_wait)) {
-            set_bit(0, &item->eventpoll->should_wake);
-            printk(KERN_ALERT "    Trying To Wake\n");
-            wake_up_all(&item->eventpoll->poll_wait);
-        } else {
-            printk(KERN_ALERT "    Not waking, null event\n");
-        }
+        /* Events first, so whoever collects the item gets them */
+        tcp_ep_item_add_events(item, mask);
+        if (add_item_to_readylist(item))
+            tcp_epoll_wake_poller(item->eventpoll);
+    } else {
+        atomic_inc(&item->eventpoll->stat_wakeups_ignored);
     }
-    printk(KERN_ALERT "Unlocking\n");
     write_unlock_irqrestore(&item->lock, flags);
+}
 
-    return 1;
+/* Socket callback backend */
+/*---------------------------------------------------------------------------*/
+/*
+ * Instead of sleeping on the sockets wait queue (and being woken for
+ * everything, ACKs included, through the generic wait queue walk) an item
+ * can take over the sockets callbacks. Each callback knows exactly what
+ * happened, so the item is queued without polling the socket and events
+ * it doesn't report never touch it. The sockets own callbacks are still
+ * called after ours. Returns non zero if the socket is already hooked by
+ * someone else.
+ */
+static int tcp_ep_item_hook(struct tcp_ep_item *item)
+{
+    struct sock *sk = item->sock->sk;
+
+    write_lock_bh(&sk->sk_callback_lock);
+    if (sk->sk_user_data) {
+        write_unlock_bh(&sk->sk_callback_lock);
+        return -EBUSY;
+    }
+    item->saved_data_ready = sk->sk_data_ready;
+    item->saved_state_change = sk->sk_state_change;
+    item->saved_write_space = sk->sk_write_space;
+    sk->sk_user_data = item;
+    sk->sk_data_ready = tcp_ep_data_ready;
+    sk->sk_state_change = tcp_ep_state_change;
+    sk->sk_write_space = tcp_ep_write_space;
+    write_unlock_bh(&sk->sk_callback_lock);
+    return 0;
 }
 
-static inline struct tcp_ep_item *tcp_ep_item_from_wait(wait_queue_t *p) {
-    return container_of(p, struct tcp_ep_item, wait);
+/* Once this returns no callback can be looking at the item */
+static void tcp_ep_item_unhook(struct tcp_ep_item *item)
+{
+    struct sock *sk = item->sock->sk;
+
+    write_lock_bh(&sk->sk_callback_lock);
+    if (sk->sk_user_data == item) {
+        sk->sk_data_ready = item->saved_data_ready;
+        sk->sk_state_change = item->saved_state_change;
+        sk->sk_write_space = item->saved_write_space;
+        sk->sk_user_data = NULL;
+    }
+    write_unlock_bh(&sk->sk_callback_lock);
 }
 
-/* Item must be properly locked if necessary, rddlist will be lock by method */
-static inline void add_item_to_readylist(struct tcp_ep_item *item)
+static void tcp_ep_data_ready(struct sock *sk, int bytes)
 {
-    unsigned long flags;
-    struct tcp_eventpoll *ep = item->eventpoll;
-    /* Trixy, if we are already in the read list nothing to do */
-    if (!list_empty(&item->rd_list))
+    void (*saved)(struct sock *sk, int bytes) = NULL;
+    struct tcp_ep_item *item;
+
+    read_lock(&sk->sk_callback_lock);
+    item = sk->sk_user_data;
+    if (item) {
+        tcp_epoll_item_wake(item, POLLIN | POLLRDNORM);
+        saved = item->saved_data_ready;
+    }
+    read_unlock(&sk->sk_callback_lock);
+
+    if (saved)
+        saved(sk, bytes);
+}
+
+/* The same as tcp_poll works out for errors and shutdowns */
+static void tcp_ep_state_change(struct sock *sk)
+{
+    void (*saved)(struct sock *sk) = NULL;
+    struct tcp_ep_item *item;
+    unsigned int mask = 0;
+
+    if (sk->sk_err)
+        mask |= POLLERR;
+    if (sk->sk_shutdown == SHUTDOWN_MASK || sk->sk_state == TCP_CLOSE)
+        mask |= POLLHUP;
+    if (sk->sk_shutdown & RCV_SHUTDOWN)
+        mask |= POLLIN | POLLRDNORM | POLLRDHUP;
+
+    read_lock(&sk->sk_callback_lock);
+    item = sk->sk_user_data;
+    if (item) {
+        /* Established and the like, nothing to report */
+        if (mask)
+            tcp_epoll_item_wake(item, mask);
+        saved = item->saved_state_change;
+    }
+    read_unlock(&sk->sk_callback_lock);
+
+    if (saved)
+        saved(sk);
+}
+
+static void tcp_ep_write_space(struct sock *sk)
+{
+    void (*saved)(struct sock *sk) = NULL;
+    struct tcp_ep_item *item;
+
+    read_lock(&sk->sk_callback_lock);
+    item = sk->sk_user_data;
+    if (item) {
+        tcp_epoll_item_wake(item, POLLOUT | POLLWRNORM);
+        saved = item->saved_write_space;
+    }
+    read_unlock(&sk->sk_callback_lock);
+
+    if (saved)
+        saved(sk);
+}
+
+/*
+ * Sleep until something is pushed, we are kicked or stopped, or timeout
+ * jiffies pass. Setting sleeping before we look at the ready list (and
+ * wakers pushing before they look at sleeping) means one of us always
+ * sees the other, so nothing pushed can be missed. Returns the time left.
+ */
+static long tcp_epoll_sleep(struct tcp_eventpoll *ep, long timeout)
+{
+    /* Don't leave a part batch of dead items waiting while we are idle */
+    if (atomic_read(&ep->dead_count))
+        tcp_ep_free_flush(ep);
+
+    ep->poller = current;
+    while (timeout) {
+        atomic_set(&ep->sleeping, 1);
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (tcp_epoll_backlog(ep) || test_bit(0, &ep->kicked) ||
+            kthread_should_stop() || signal_pending(current))
+            break;
+        timeout = schedule_timeout(timeout);
+    }
+    __set_current_state(TASK_RUNNING);
+    atomic_set(&ep->sleeping, 0);
+    return timeout;
+}
+
+/*
+ * Wake the poller if it is asleep. Only the first waker to see it
+ * sleeping does, everyone else (and everyone while it is draining)
+ * gets away with a read.
+ */
+static inline void tcp_epoll_wake_poller(struct tcp_eventpoll *ep)
+{
+    struct task_struct *poller;
+
+    /* Our push (or kick) before their sleeping */
+    smp_mb();
+    if (!atomic_read(&ep->sleeping) || atomic_cmpxchg(&ep->sleeping, 1, 0) != 1)
         return;
-    /* in demand, hold for as short a time as  possible */
-    write_lock_irqsave(&ep->list_lock, flags);
-    list_add(&item->rd_list, &ep->ready_list);
-    write_unlock_irqrestore(&ep->list_lock, flags);
+
+    atomic_inc(&ep->stat_poller_wakeups);
+    /* The poller could be stopped and gone by the time we get to it,
+     * task structs are freed after a grace period */
+    rcu_read_lock();
+    poller = ep->poller;
+    if (poller)
+        wake_up_process(poller);
+    rcu_read_unlock();
+}
+
+static inline struct tcp_ep_item *tcp_ep_item_from_wait(wait_queue_t *p) {
+    return container_of(p, struct tcp_ep_item, wait);
 }
 
-static inline void remove_item_from_readylist(struct tcp_ep_item *item)
+/*
+ * Push the item for collection, unless it already is (or it is disarmed,
+ * or being destroyed). Never takes a lock, so any number of wakeups on
+ * any cpus can push at once. Returns 1 if the item was pushed.
+ */
+static inline int add_item_to_readylist(struct tcp_ep_item *item)
 {
-    unsigned long flags;
     struct tcp_eventpoll *ep = item->eventpoll;
-    /* in demand, hold for as short a time as  possible */
-    write_lock_irqsave(&ep->list_lock, flags);
-    list_del_init(&item->rd_list);
-    write_unlock_irqrestore(&ep->list_lock, flags);
+    struct tcp_ep_item *first;
+    int old;
+
+    /* Trixy, if we are already in the ready list nothing to do */
+    do {
+        old = atomic_read(&item->rd_state);
+        if (old & (TCP_EP_RD_QUEUED | TCP_EP_RD_DISARMED | TCP_EP_RD_DEAD))
+            return 0;
+    } while (atomic_cmpxchg(&item->rd_state, old, old | TCP_EP_RD_QUEUED) != old);
+
+    item->rd_since = jiffies;
+    atomic_inc(&ep->ready_len);
+    for (;;) {
+        first = ep->rd_head;
+        item->rd_next = first;
+        if (cmpxchg(&ep->rd_head, first, item) == first)
+            break;
+        atomic_inc(&ep->stat_push_retries);
+    }
+    return 1;
 }
-/* RBTree Methods */
+
+/* Hash Methods */
 /*---------------------------------------------------------------------------*/
-/* All of the blow methods work on the assumption that the caller has done the correct locking */
+/* Insert and remove must be called with the eventpoll lock held for write */
 static int tcp_ep_hash_insert(struct tcp_ep_item *item)
 {
-    int cmp;
     struct tcp_eventpoll *ep = item->eventpoll;
-    struct rb_node **p = &ep->hash_root.rb_node;
-    struct rb_node *parent = NULL;
+    struct tcp_ep_hash *hash = ep->hash;
+    struct hlist_head *bucket;
+    struct hlist_node *pos;
     struct tcp_ep_item *epic;
 
-    while (*p) {
-        parent = *p;
-        epic = rb_entry(parent, struct tcp_ep_item, hash_node);
-        cmp = tcp_cmp_sock(epic->sock, item->sock);
-        if (cmp == 0)
+    bucket = &hash->buckets[tcp_ep_key_hash(ep, &item->key) & (hash->size - 1)];
+    hlist_for_each_entry(epic, pos, bucket, hash_node) {
+        if (tcp_ep_key_equal(&epic->key, &item->key))
             return -1;
-        p = cmp > 0 ? &parent->rb_right : &parent->rb_left;
     }
 
-    rb_link_node(&item->hash_node, parent, p);
-    rb_insert_color(&item->hash_node, &ep->hash_root);
-
+    hlist_add_head_rcu(&item->hash_node, bucket);
+    ep->hash_count++;
     return 0;
 }
 
-static inline void tcp_ep_rb_initnode(struct rb_node *n)
+static void tcp_ep_hash_remove(struct tcp_ep_item *item)
 {
-    rb_set_parent(n, n);
+    if (hlist_unhashed(&item->hash_node))
+        return;
+    hlist_del_rcu(&item->hash_node);
+    item->eventpoll->hash_count--;
 }
 
-static inline void tcp_ep_rb_removenode(struct rb_node *n, struct rb_root *r)
+/*
+ * Find the item for a socket without taking any locks. A resize moving
+ * items between tables under us could make us miss, so if we come up
+ * empty and the table changed, look again. The caller has to make sure
+ * the item isn't removed while it uses it (it owns the connection).
+ */
+static struct tcp_ep_item *tcp_ep_hash_find(struct tcp_eventpoll *ep, struct socket *sock)
 {
-    rb_erase(n, r);
-    rb_set_parent(n, n);
+    struct tcp_ep_hash *hash;
+    struct tcp_ep_item *item, *found;
+    struct hlist_node *pos;
+    struct tcp_ep_key key;
+    unsigned int h, seq;
+
+    tcp_ep_key_from_sock(&key, sock);
+    h = tcp_ep_key_hash(ep, &key);
+
+    do {
+        found = NULL;
+        seq = read_seqcount_begin(&ep->hash_seq);
+        rcu_read_lock();
+        hash = rcu_dereference(ep->hash);
+        hlist_for_each_entry_rcu(item, pos, &hash->buckets[h & (hash->size - 1)], hash_node) {
+            if (tcp_ep_key_equal(&item->key, &key)) {
+                found = item;
+                break;
+            }
+        }
+        rcu_read_unlock();
+    } while (!found && read_seqcount_retry(&ep->hash_seq, seq));
+
+    return found;
 }
 
-static struct tcp_ep_item *tcp_ep_hash_find(struct tcp_eventpoll *eventpoll, struct socket *sock) {
-    struct rb_node *rbn;
-    struct tcp_ep_item *item = NULL;
-    int cmp;
-    int found = 0;
+/*
+ * Grow or shrink the hash to fit how many items we have. Allocating the
+ * new table and freeing the old one both sleep, so only the move itself
+ * happens under the lock.
+ */
+static void tcp_ep_hash_resize(struct tcp_eventpoll *ep)
+{
+    struct tcp_ep_hash *old, *new;
+    struct tcp_ep_item *item;
+    struct hlist_node *pos, *next;
+    unsigned int size, oldsize, i;
+
+    /* Aim for about one item a bucket, we grow again at two and
+     * shrink at an eighth so we don't flap */
+    size = TCP_EP_HASH_MIN;
+    while (size < ep->hash_count)
+        size <<= 1;
+    oldsize = ep->hash->size;
+    if (size == oldsize)
+        return;
+
+    new = tcp_ep_hash_alloc(size, ep->node);
+    if (!new)
+        return; /* Just run with longer chains */
 
-    /* Start at root, traverse tree */
-    rbn = eventpoll->hash_root.rb_node;
-    while (rbn) {
-        item = rb_entry(rbn, struct tcp_ep_item, hash_node);
-        cmp = tcp_cmp_sock(sock, item->sock);
-        if (cmp == 0) {
-            found = 1;
-            break;
+    write_lock(&ep->lock);
+    old = ep->hash;
+    /* Someone beat us to it */
+    if (old->size != oldsize) {
+        write_unlock(&ep->lock);
+        tcp_ep_hash_free(new);
+        return;
+    }
+
+    write_seqcount_begin(&ep->hash_seq);
+    for (i = 0; i < old->size; i++) {
+        hlist_for_each_entry_safe(item, pos, next, &old->buckets[i], hash_node) {
+            hlist_del_rcu(&item->hash_node);
+            hlist_add_head_rcu(&item->hash_node,
+                &new->buckets[tcp_ep_key_hash(ep, &item->key) & (size - 1)]);
         }
-        rbn = cmp < 0 ? rbn->rb_left : rbn->rb_right;
     }
+    rcu_assign_pointer(ep->hash, new);
+    write_seqcount_end(&ep->hash_seq);
+    write_unlock(&ep->lock);
+
+    printk(KERN_ALERT "Resized epoll hash on cpu %d from %u to %u\n", ep->cpu, oldsize, size);
+
+    /* Free it once any lookups still in the old table finish, without
+     * holding up the herder or acceptor that got us here */
+    call_rcu(&old->rcu, tcp_ep_hash_free_rcu);
+}
 
-    /* If not found return null */
-    return found ? item : NULL;
+static struct tcp_ep_hash *tcp_ep_hash_alloc(unsigned int size, int node)
+{
+    struct tcp_ep_hash *hash;
+    size_t bytes = sizeof(struct tcp_ep_hash) + size * sizeof(struct hlist_head);
+    int vmalloced = 0;
+    unsigned int i;
+
+    /* Big tables won't come from kmalloc */
+    if (bytes <= PAGE_SIZE * 4) {
+        hash = kmalloc_node(bytes, GFP_KERNEL, node);
+    } else {
+        hash = vmalloc_node(bytes, node);
+        vmalloced = 1;
+    }
+    if (!hash)
+        return NULL;
+
+    hash->size = size;
+    hash->vmalloced = vmalloced;
+    for (i = 0; i < size; i++)
+        INIT_HLIST_HEAD(&hash->buckets[i]);
+    return hash;
 }
 
-static inline int tcp_cmp_sock(struct socket *leftsock, struct socket *rightsock)
+static void tcp_ep_hash_free(struct tcp_ep_hash *hash)
 {
-    struct inet_sock *leftsk = inet_sk(leftsock->sk);
-    struct inet_sock *rightsk = inet_sk(rightsock->sk);
+    if (!hash)
+        return;
+    if (hash->vmalloced)
+        vfree(hash);
+    else
+        kfree(hash);
+}
 
-    /* This compares both the daddr and dport, if both match
-     * the sockets are the same */
-    __u32 diff = leftsk->daddr - rightsk->daddr;
+static void tcp_ep_hash_free_rcu(struct rcu_head *head)
+{
+    struct tcp_ep_hash *hash = container_of(head, struct tcp_ep_hash, rcu);
 
-    if (!diff) {
-        diff = leftsk->dport - rightsk->dport;
+    if (!hash->vmalloced) {
+        kfree(hash);
+        return;
     }
+    spin_lock(&tcp_ep_reap_lock);
+    hash->reap_next = tcp_ep_reap_hashes;
+    tcp_ep_reap_hashes = hash;
+    spin_unlock(&tcp_ep_reap_lock);
+
+    schedule_work(&tcp_ep_reap_work);
+}
 
-    return diff;
+static inline void tcp_ep_key_from_sock(struct tcp_ep_key *key, struct socket *sock)
+{
+    struct inet_sock *isk = inet_sk(sock->sk);
+
+    key->daddr = isk->daddr;
+    key->saddr = isk->rcv_saddr;
+    key->dport = isk->dport;
+    key->sport = isk->sport;
+}
+
+static inline int tcp_ep_key_equal(const struct tcp_ep_key *a, const struct tcp_ep_key *b)
+{
+    return a->daddr == b->daddr && a->saddr == b->saddr &&
+           a->dport == b->dport && a->sport == b->sport;
+}
+
+static inline unsigned int tcp_ep_key_hash(struct tcp_eventpoll *ep, const struct tcp_ep_key *key)
+{
+    return jhash_3words((__force u32)key->daddr, (__force u32)key->saddr,
+                        ((__force u32)key->dport << 16) | (__force u32)key->sport,
+                        ep->hash_rnd);
 }
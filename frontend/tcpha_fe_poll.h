@@ -21,8 +21,11 @@
 #include <linux/hash.h>
 #include <linux/spinlock.h>
 #include <linux/rwsem.h>
-#include <linux/rbtree.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/jhash.h>
 #include <linux/wait.h>
+#include <linux/workqueue.h>
 #include <linux/bitops.h>
 #include <linux/mutex.h>
 #include <linux/net.h>
@@ -30,38 +33,109 @@
 #include <asm/atomic.h>
 #include  "tcpha_fe_client_connection.h"
 
+/* Ready list delay histogram, bucket n counts delays under 2^n jiffies */
+#define TCP_EPOLL_DELAY_BUCKETS 8
+
+/* Item modes, passed in with the poll flags on insert/setflags */
+#define TCP_EPOLLET (1U << 31)	/* Only report data that is new since last time */
+#define TCP_EPOLLONESHOT (1U << 30)	/* Disarm once collected, until setflags */
+#define TCP_EPOLL_MODES (TCP_EPOLLET | TCP_EPOLLONESHOT)
+
+/* Smallest (and starting) size of an eventpolls item hash */
+#define TCP_EP_HASH_MIN 64
+
+struct tcp_ep_hash; /* Private to tcpha_fe_poll.c */
+
 /* The primary structure representing an epoll item */
 struct tcp_eventpoll {
 	/* Structure lock, protects against concurrent modification issues */
 	rwlock_t lock;
 
-	/* The head used by tcph_epoll_wait */
-	wait_queue_head_t poll_wait;
-	
-	/* List of ready to use sockets */
-	struct list_head ready_list;
+	/* The one thread that sleeps in tcp_epoll_wait. Wakers only
+	 * wake it if they are first to see sleeping set, and it only
+	 * sleeps once it has set sleeping and seen nothing ready. */
+	struct task_struct *poller;
+	atomic_t sleeping;
+	unsigned long kicked; /* Bit 0, tcp_epoll_kick since the last wait */
+
+	/* Ready items. Wakeups push on to rd_head without locking, whoever
+	 * collects (the poller or a thief, under consume_lock) takes the
+	 * whole stack at once and moves it on to ready_list in order. */
+	struct tcp_ep_item *rd_head;
+	struct list_head ready_list; /* Only under consume_lock */
+	spinlock_t consume_lock;
+	atomic_t ready_len; /* Items pushed and not yet collected */
+
+	/* Dead items, waiting to make up a batch to be freed together
+	 * after one grace period */
+	struct tcp_ep_item *dead_head;
+	atomic_t dead_count;
+	unsigned long dead_since; /* Jiffies the oldest of them died */
 
-	/* Conccurent modification of ready list */
-	/* Provided seperately as its modified from an interrupt
-	 * context */
-	rwlock_t list_lock;
+	/* Hash of our items by connection 4-tuple. Lookups take no locks,
+	 * changes are made under lock. Resizing swaps the table under
+	 * hash_seq so a racing lookup knows to try again. */
+	struct tcp_ep_hash *hash;
+	seqcount_t hash_seq;
+	unsigned int hash_count; /* Items in the hash */
+	u32 hash_rnd;
 
-	/* RB-Tree used as hash table to store monitore socket structs */
-	struct rb_root hash_root;
+	/* The cpu our poller runs on */
+	int cpu;
+	/* The memory node items are allocated on */
+	int node;
 
-	volatile unsigned long should_wake;
+	/* Stats, socket wakeups and how many happened on another cpu */
+	atomic_t stat_wakeups;
+	atomic_t stat_remote_wakeups;
+	atomic_t stat_wakeups_ignored; /* Disarmed, or nothing new for ET */
+	atomic_t stat_push_retries; /* Pushes that raced another push */
+	atomic_t stat_polls; /* Times we had to ask the socket for its events */
+	atomic_t stat_poller_wakeups; /* Times the poller was actually woken */
+	atomic_t stat_freed; /* Items handed to a grace period */
+	atomic_t stat_free_batches; /* And how many grace periods that took */
+
+	/* Current busy poll budget in microseconds, adapts between
+	 * 1 and tcphafe_busy_poll_us. Only the poller touches these. */
+	int busy_poll_us;
+	unsigned long stat_spin_hits; /* Spins that found work */
+	unsigned long stat_spin_misses; /* Spins that went to sleep anyway */
+
+	/* How long items sat on the ready list before being collected,
+	 * changed under consume_lock */
+	unsigned long stat_max_delay;
+	unsigned long stat_delay[TCP_EPOLL_DELAY_BUCKETS];
 };
 
 /* Epoll setup and destroy */
-extern int tcp_epoll_init(struct tcp_eventpoll **eventpoll);
+extern int tcp_epoll_init(struct tcp_eventpoll **eventpoll, int node);
 extern void tcp_epoll_destroy(struct tcp_eventpoll *eventpoll);
 
 /* Methods to add/remove/modify sockets */
 extern int tcp_epoll_insert(struct tcp_eventpoll *eventpoll, struct tcpha_fe_conn *conn, unsigned int flags);
+extern int tcp_epoll_insert_batch(struct tcp_eventpoll *eventpoll, struct tcpha_fe_conn *conns[], int nconns, unsigned int flags);
 extern void tcp_epoll_remove(struct tcp_eventpoll *eventpoll, struct tcpha_fe_conn *conn);
 extern int tcp_epoll_setflags(struct tcp_eventpoll *eventpoll, struct tcpha_fe_conn *conn, unsigned int flags);
 
-/* Polling the epoll */
-extern int tcp_epoll_wait(struct tcp_eventpoll *eventpoll, struct tcpha_fe_conn *conns[], int maxevents);
+/* The same for callers that already have the item (conn->ep_item), and
+ * so need no lookup. The caller must own the connection. */
+extern void tcp_epoll_item_remove(struct tcp_ep_item *item);
+extern int tcp_epoll_item_setflags(struct tcp_ep_item *item, unsigned int flags);
+
+/* Polling the epoll. Sleeps for up to timeout jiffies (forever with
+ * MAX_SCHEDULE_TIMEOUT, not at all with 0) or until the jiffies deadline
+ * if nothing is ready. Returns 0 when the time is up. */
+extern int tcp_epoll_wait(struct tcp_eventpoll *eventpoll, struct tcpha_fe_conn *conns[], int maxevents, long timeout);
+extern int tcp_epoll_wait_until(struct tcp_eventpoll *eventpoll, struct tcpha_fe_conn *conns[], int maxevents, unsigned long deadline);
+
+/* Taking work from another epoll, these never sleep */
+extern int tcp_epoll_steal(struct tcp_eventpoll *eventpoll, struct tcpha_fe_conn *conns[], int maxevents);
+extern void tcp_epoll_kick(struct tcp_eventpoll *eventpoll);
+
+/* About how many items are waiting to be collected */
+static inline int tcp_epoll_backlog(struct tcp_eventpoll *eventpoll)
+{
+	return atomic_read(&eventpoll->ready_len);
+}
 
 #endif
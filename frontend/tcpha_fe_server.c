@@ -8,21 +8,46 @@
 #include "tcpha_fe_server.h"
 #include "tcpha_fe_client_connection.h"
 #include "tcpha_fe_socket_functions.h"
+#include <linux/wait.h>
 
 int tcphafe_max_backlog = 2048;
-int main_sleep_time = 1 * HZ;
+
+/* What over budget clients get told when conf.shed_mode is TCPHA_SHED_503 */
+static const char tcpha_fe_busy_response[] =
+	"HTTP/1.0 503 Service Unavailable\r\n"
+	"Content-Length: 0\r\n"
+	"Connection: close\r\n"
+	"\r\n";
+
+/* Private Methods */
+/*---------------------------------------------------------------------------*/
+static int tcpha_fe_server_accept_all(struct tcpha_fe_server *server, int cpu, int batches);
+static void tcpha_fe_server_shed(struct tcpha_fe_server *server, struct socket *sock);
+static void tcpha_fe_server_wait_accept(struct tcpha_fe_server *server);
+
+static int start_acceptors(struct tcpha_fe_server *server);
+static void stop_acceptors(struct tcpha_fe_server *server);
+static int tcpha_fe_acceptor_run(void *data);
+static int tcpha_fe_acceptor_wakeup(wait_queue_t *curr, unsigned mode, int sync, void *key);
+
+static void tcpha_fe_listen_data_ready(struct sock *sk, int bytes);
+static void tcpha_fe_server_unhook_child(struct sock *sk);
 
 /**
  * The fe_server_daemon is responsible for setting up and
  * maintaining the worker daemons, and dealing with the accepts
- * on the listening socket. It actively polls (instead of being interrupt driven)
- * on the main socket.
+ * on the listening socket. It sleeps on the listening socket's wait
+ * queue (the same one sk_data_ready wakes when a connection lands in the
+ * accept queue) and drains the whole accept queue each time it is woken.
+ *
+ * With conf.per_cpu_accept set it instead starts one acceptor per herder
+ * cpu and just waits to be stopped.
  */
 int tcpha_fe_server_daemon(void * __service)
 {
 	/* Variables for dealing with server */
 	struct tcpha_fe_server *server = (struct tcpha_fe_server*)__service;
-	struct socket *newsock;
+	DECLARE_WAITQUEUE(wait, current);
 	int err;
 	printk(KERN_ALERT "Server Starting Up\n");
 
@@ -31,37 +56,252 @@ int tcpha_fe_server_daemon(void * __service)
 	if (err < 0)
 		goto server_setup_fail;
 
+	/* Tell the herders how much they can take */
+	atomic_set(&server->shed, 0);
+	tcpha_fe_conn_set_budget(server->herders,
+				 server->conf.max_clients > 0 ?
+				 server->conf.max_clients : TCPHA_MAX_CONNECTIONS,
+				 server->conf.max_herder_clients);
+
+	if (server->conf.per_cpu_accept) {
+		err = start_acceptors(server);
+		if (err < 0)
+			goto acceptor_setup_fail;
+	} else {
+		add_wait_queue(server->mainsock->sk->sk_sleep, &wait);
+	}
+
 	/* We are go */
 	atomic_set(&server->running, 1);
 	while (!kthread_should_stop()) {
-		/* List for accepts on the main socket */
-		err = kernel_accept(server->mainsock, &newsock, O_NONBLOCK);
-		if (err < 0) {
-			schedule_timeout_interruptible(main_sleep_time);
-		} else {
-			err = tcpha_fe_conn_create(server->herders, newsock);
-			if (err < 0)
-				goto connection_err;
-
-			printk(KERN_ALERT "Connection made\n");
-			continue;
-connection_err:
-			sock_release(newsock);
+		if (server->conf.per_cpu_accept) {
+			/* Nothing to do but wait for kthread_stop */
+			set_current_state(TASK_INTERRUPTIBLE);
+			if (!kthread_should_stop())
+				schedule();
+			__set_current_state(TASK_RUNNING);
 			continue;
 		}
+
+		tcpha_fe_server_wait_accept(server);
+		tcpha_fe_server_accept_all(server, -1, 0);
 	}
 
+	if (server->conf.per_cpu_accept)
+		stop_acceptors(server);
+	else
+		remove_wait_queue(server->mainsock->sk->sk_sleep, &wait);
+
 	/* We are done */
-	printk(KERN_ALERT "Server Shutting Down\n");
+	printk(KERN_ALERT "Server Shutting Down, %d connections refused\n",
+	       atomic_read(&server->shed));
 	pull_down_server_socket(server);
 	atomic_set(&server->running, 0);
 	return 0;
 
+acceptor_setup_fail:
+	pull_down_server_socket(server);
 server_setup_fail:
 	printk(KERN_ALERT "Server Failed to Initialize\n");
 	return -1;	
 }
 
+/**
+ * Sleep until the accept queue of the main socket has something in it.
+ * The caller must already be hooked onto the socket's wait queue.
+ */
+static void tcpha_fe_server_wait_accept(struct tcpha_fe_server *server)
+{
+	struct inet_connection_sock *icsk = inet_csk(server->mainsock->sk);
+
+	/* Set our state before looking at the queue so a connection
+	 * arriving between the check and schedule() still wakes us. */
+	set_current_state(TASK_INTERRUPTIBLE);
+	if (!kthread_should_stop() &&
+	    reqsk_queue_empty(&icsk->icsk_accept_queue))
+		schedule();
+	__set_current_state(TASK_RUNNING);
+}
+
+/**
+ * Accept every connection currently sitting in the accept queue of the
+ * main socket and hand them to the herders, TCPHA_CONN_BATCH at a time,
+ * stopping after batches of them if batches is not 0. If cpu is not -1
+ * connections that arrived on that cpu go to its herder, the rest to the
+ * herder of the cpu they arrived on. Returns the number accepted.
+ */
+static int tcpha_fe_server_accept_all(struct tcpha_fe_server *server, int cpu, int batches)
+{
+	struct socket *newsocks[TCPHA_CONN_BATCH];
+	int accepted = 0;
+	int nsocks, i;
+	int err = 0;
+	int done = 0;
+
+	while (!kthread_should_stop() && err >= 0 && (!batches || done++ < batches)) {
+		/* Fill up a batch */
+		for (nsocks = 0; nsocks < TCPHA_CONN_BATCH; nsocks++) {
+			err = kernel_accept(server->mainsock, &newsocks[nsocks], O_NONBLOCK);
+			if (err < 0)
+				break;
+			tcpha_fe_server_unhook_child(newsocks[nsocks]->sk);
+		}
+		if (!nsocks)
+			break;
+
+		accepted += tcpha_fe_conn_create_batch(server->herders, newsocks, nsocks, cpu);
+
+		/* Anything the herders couldn't take is over budget */
+		for (i = 0; i < nsocks; i++) {
+			if (newsocks[i])
+				tcpha_fe_server_shed(server, newsocks[i]);
+		}
+
+		pr_debug("Connections made: %d\n", accepted);
+		/* A long burst shouldn't hog the cpu */
+		cond_resched();
+	}
+	return accepted;
+}
+
+/**
+ * Refuse a connection as cheaply as possible, straight from the acceptor.
+ * Either reset it or write it a canned 503 and close it. Note that if the
+ * client's request is already queued (as with defer_accept) the stack will
+ * reset the connection on close anyway.
+ */
+static void tcpha_fe_server_shed(struct tcpha_fe_server *server, struct socket *sock)
+{
+	struct linger lin;
+	struct msghdr msg;
+	struct kvec vec;
+
+	atomic_inc(&server->shed);
+	if (server->conf.shed_mode == TCPHA_SHED_503) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_flags = MSG_DONTWAIT;
+		vec.iov_base = (void *)tcpha_fe_busy_response;
+		vec.iov_len = sizeof(tcpha_fe_busy_response) - 1;
+		kernel_sendmsg(sock, &msg, &vec, 1, vec.iov_len);
+	} else {
+		/* A zero linger makes the close send a RST */
+		lin.l_onoff = 1;
+		lin.l_linger = 0;
+		kernel_setsockopt(sock, SOL_SOCKET, SO_LINGER,
+				  (char *)&lin, sizeof(lin));
+	}
+	sock_release(sock);
+}
+
+/* Per cpu acceptors */
+/*---------------------------------------------------------------------------*/
+/**
+ * Start an acceptor on every cpu that has a herder and hook the main
+ * socket so each new connection wakes the acceptor on the cpu that
+ * finished its handshake.
+ */
+static int start_acceptors(struct tcpha_fe_server *server)
+{
+	struct tcpha_fe_acceptor *acceptor;
+	int cpu;
+
+	memset(server->acceptors, 0, sizeof(server->acceptors));
+	for_each_online_cpu(cpu) {
+		if (!server->herders->by_cpu[cpu])
+			continue;
+
+		acceptor = kmalloc_node(sizeof(struct tcpha_fe_acceptor), GFP_KERNEL,
+				       cpu_to_node(cpu));
+		if (!acceptor)
+			goto acceptor_fail;
+		acceptor->server = server;
+		acceptor->cpu = cpu;
+		acceptor->task = kthread_create(tcpha_fe_acceptor_run, acceptor,
+						"TCPHA Acceptor %u", cpu);
+		if (IS_ERR(acceptor->task)) {
+			kfree(acceptor);
+			goto acceptor_fail;
+		}
+		kthread_bind(acceptor->task, cpu);
+		server->acceptors[cpu] = acceptor;
+		printk(KERN_ALERT "Adding Acceptor for CPU: %u\n", cpu);
+	}
+
+	/* Only hook the socket once everyone exists */
+	init_waitqueue_func_entry(&server->accept_wait, tcpha_fe_acceptor_wakeup);
+	add_wait_queue(server->mainsock->sk->sk_sleep, &server->accept_wait);
+
+	for_each_online_cpu(cpu) {
+		if (server->acceptors[cpu])
+			wake_up_process(server->acceptors[cpu]->task);
+	}
+	return 0;
+
+acceptor_fail:
+	printk(KERN_ALERT "Error Making Acceptor Process\n");
+	for_each_online_cpu(cpu) {
+		if (!server->acceptors[cpu])
+			continue;
+		/* Never woken, so kthread_stop is the only way out */
+		kthread_stop(server->acceptors[cpu]->task);
+		kfree(server->acceptors[cpu]);
+		server->acceptors[cpu] = NULL;
+	}
+	return -ENOMEM;
+}
+
+static void stop_acceptors(struct tcpha_fe_server *server)
+{
+	int cpu;
+
+	remove_wait_queue(server->mainsock->sk->sk_sleep, &server->accept_wait);
+	for (cpu = 0; cpu < NR_CPUS; cpu++) {
+		if (!server->acceptors[cpu])
+			continue;
+		printk(KERN_ALERT "   Stoping Acceptor %u ... ", cpu);
+		kthread_stop(server->acceptors[cpu]->task);
+		kfree(server->acceptors[cpu]);
+		server->acceptors[cpu] = NULL;
+	}
+}
+
+static int tcpha_fe_acceptor_run(void *data)
+{
+	struct tcpha_fe_acceptor *acceptor = (struct tcpha_fe_acceptor*)data;
+
+	printk(KERN_ALERT "Running Acceptor %u\n", acceptor->cpu);
+	while (!kthread_should_stop()) {
+		/* The queue is shared, so don't hog a burst that woke the
+		 * other acceptors too, they will be along for their share */
+		tcpha_fe_server_wait_accept(acceptor->server);
+		tcpha_fe_server_accept_all(acceptor->server, acceptor->cpu, 1);
+	}
+	printk(KERN_ALERT "Acceptor %u Shutting Down\n", acceptor->cpu);
+	return 0;
+}
+
+/* Called from the listener's wakeup (softirq, on the cpu that finished the
+ * handshake). Wake only that cpu's acceptor, or any acceptor if it has none. */
+static int tcpha_fe_acceptor_wakeup(wait_queue_t *curr, unsigned mode, int sync, void *key)
+{
+	struct tcpha_fe_server *server;
+	int cpu = smp_processor_id();
+
+	server = container_of(curr, struct tcpha_fe_server, accept_wait);
+	if (server->acceptors[cpu]) {
+		wake_up_process(server->acceptors[cpu]->task);
+		return 1;
+	}
+
+	for_each_online_cpu(cpu) {
+		if (server->acceptors[cpu]) {
+			wake_up_process(server->acceptors[cpu]->task);
+			return 1;
+		}
+	}
+	return 0;
+}
+
 /**
  * Setup the listening socket for the main accept thread.
  */
@@ -69,6 +309,7 @@ int setup_server_socket(struct tcpha_fe_server *server)
 {
 	struct socket *sock;
 	struct sockaddr_in sin;
+	int defer;
 	int error;
 	printk(KERN_ALERT "Creating Main Socket\n");
 
@@ -94,6 +335,16 @@ int setup_server_socket(struct tcpha_fe_server *server)
 		return error;
 	}
 
+	/* Only let connections out of accept once they have sent us something,
+	 * so idle clients never cost us a connection or an epoll item */
+	if (server->conf.defer_accept) {
+		defer = server->conf.defer_accept;
+		error = kernel_setsockopt(sock, SOL_TCP, TCP_DEFER_ACCEPT,
+					  (char *)&defer, sizeof(defer));
+		if (error < 0)
+			printk(KERN_ERR "Error setting TCP_DEFER_ACCEPT, accepting everything\n");
+	}
+
 	printk(KERN_ALERT "Listening on Main Socket\n");
 	/* Now, start listening on the socket */
 	error = kernel_listen(sock, tcphafe_max_backlog);
@@ -102,6 +353,14 @@ int setup_server_socket(struct tcpha_fe_server *server)
 		return error;
 	}
 
+	/* Hook the listener so we know which cpu each connection arrived on.
+	 * Always, placement can be switched to flow affinity at any time. */
+	write_lock_bh(&sock->sk->sk_callback_lock);
+	server->listen_data_ready = sock->sk->sk_data_ready;
+	sock->sk->sk_user_data = server;
+	sock->sk->sk_data_ready = tcpha_fe_listen_data_ready;
+	write_unlock_bh(&sock->sk->sk_callback_lock);
+
 	server->mainsock = sock;
 	return 0;
 }
@@ -111,6 +370,67 @@ int setup_server_socket(struct tcpha_fe_server *server)
  */
 void pull_down_server_socket(struct tcpha_fe_server *server)
 {
+	struct sock *sk = server->mainsock->sk;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	if (sk->sk_data_ready == tcpha_fe_listen_data_ready) {
+		sk->sk_data_ready = server->listen_data_ready;
+		sk->sk_user_data = NULL;
+	}
+	write_unlock_bh(&sk->sk_callback_lock);
+
 	sock_release(server->mainsock);
 }
 
+/*
+ * Called (in softirq, with the listener locked) when a connection finishes
+ * its handshake and has just been put on the tail of the accept queue.
+ * Remember the cpu the flow came in on for the herder placement.
+ *
+ * Connections are cloned from the listener, this hook and sk_user_data
+ * included, so it also runs for data reaching a connection still waiting
+ * to be accepted. Those get their own callback back and go on to it.
+ */
+static void tcpha_fe_listen_data_ready(struct sock *sk, int bytes)
+{
+	struct tcpha_fe_server *server;
+	struct request_sock *req;
+
+	if (sk->sk_state != TCP_LISTEN) {
+		tcpha_fe_server_unhook_child(sk);
+		sk->sk_data_ready(sk, bytes);
+		return;
+	}
+
+	read_lock(&sk->sk_callback_lock);
+	server = sk->sk_user_data;
+	req = inet_csk(sk)->icsk_accept_queue.rskq_accept_tail;
+	if (req && req->sk)
+		tcpha_fe_set_rx_cpu(req->sk, smp_processor_id());
+	read_unlock(&sk->sk_callback_lock);
+
+	if (server)
+		server->listen_data_ready(sk, bytes);
+}
+
+/*
+ * Connections are cloned from the listener, hook and all. Give them back
+ * the plain callback (from the server they inherited in sk_user_data) so
+ * they are free to be hooked themselves. Done by the hook on the first
+ * data before accept, and by the acceptor for anything still hooked.
+ * Their rx cpu is not kept in the socket, so this can come before the
+ * herders take it.
+ */
+static void tcpha_fe_server_unhook_child(struct sock *sk)
+{
+	struct tcpha_fe_server *server;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	server = sk->sk_user_data;
+	if (server && sk->sk_data_ready == tcpha_fe_listen_data_ready) {
+		sk->sk_data_ready = server->listen_data_ready;
+		sk->sk_user_data = NULL;
+	}
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+
@@ -24,6 +24,10 @@
 
 #define TCPHA_MAX_CONNECTIONS 65536
 
+/* How connections over the budget are refused (conf.shed_mode) */
+#define TCPHA_SHED_RST 0		/* reset the connection */
+#define TCPHA_SHED_503 1		/* send a canned 503 and close */
+
 /* This is the structure representing open server connections */
 /* This structure represents the configuration of the server. */
 struct tcpha_fe_server_config {
@@ -35,10 +39,25 @@ struct tcpha_fe_server_config {
     int max_spare_servers;	/* max number of idle threads */
     int min_spare_servers;		/* min number of idle threads */
 
-    int max_clients;			/* max clients permitted */
+    int max_clients;			/* max clients permitted,
+					   0 is TCPHA_MAX_CONNECTIONS */
+    int max_herder_clients;		/* max clients in one herder, 0 is no limit */
+    int shed_mode;			/* TCPHA_SHED_* */
+
+    int per_cpu_accept;		/* run one acceptor per herder cpu */
+    int defer_accept;			/* seconds to hold connections with no
+					   data out of accept (TCP_DEFER_ACCEPT), 0 is off */
 };
 
 struct herder_list;
+struct tcpha_fe_server;
+
+/* An accept thread bound to a cpu, feeding that cpu's herder */
+struct tcpha_fe_acceptor {
+	struct tcpha_fe_server *server;
+	struct task_struct *task;
+	int cpu;
+};
 
 /* This is the structure representing a server */
 struct tcpha_fe_server {
@@ -57,8 +76,12 @@ struct tcpha_fe_server {
 
     /* run-time variables */
     struct socket *mainsock;   	/* listen socket */
+    wait_queue_t accept_wait;		/* hooks mainsock for the acceptors */
+    void (*listen_data_ready)(struct sock *sk, int bytes); /* mainsocks own */
+    struct tcpha_fe_acceptor *acceptors[NR_CPUS]; /* per cpu acceptors */
     atomic_t workercount;		/* workers counter */
     atomic_t running;				/* running flag */
+    atomic_t shed;				/* connections refused */
 
 	/* Herders */
 	struct herder_list *herders;
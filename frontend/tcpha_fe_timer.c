@@ -0,0 +1,229 @@
+#include "tcpha_fe_timer.h"
+#include <linux/kernel.h>
+
+/* Developer Notes:
+ *  Timers live in one of two levels. The first has a slot per tick for
+ *  the next TCPHA_WHEEL_L0_SIZE ticks, the second a slot per lap of the
+ *  first. Each time the first level wraps, the second level slot for the
+ *  coming lap is cascaded down into it. Everything is done under the wheel
+ *  lock, which is never taken from interrupt context.
+ */
+
+/* Private Methods */
+/*---------------------------------------------------------------------------*/
+static void __tcpha_fe_timer_add(struct tcpha_fe_wheel *wheel, struct tcpha_fe_timer *timer);
+static void tcpha_fe_wheel_cascade(struct tcpha_fe_wheel *wheel, struct list_head *slot);
+static unsigned long tcpha_fe_wheel_clock(struct tcpha_fe_wheel *wheel);
+static unsigned long tcpha_fe_wheel_ticks(struct tcpha_fe_wheel *wheel, unsigned long deadline);
+static unsigned long tcpha_fe_wheel_jiffies(struct tcpha_fe_wheel *wheel, unsigned long tick);
+
+/* Constructor/Destructor methods */
+/*---------------------------------------------------------------------------*/
+void tcpha_fe_wheel_init(struct tcpha_fe_wheel *wheel)
+{
+    int i;
+
+    spin_lock_init(&wheel->lock);
+    wheel->clock = 0;
+    wheel->clock_j = jiffies;
+    wheel->now = 0;
+    wheel->next = 0;
+    wheel->due = wheel->clock_j;
+    wheel->count = 0;
+    for (i = 0; i < TCPHA_WHEEL_L0_SIZE; i++)
+        INIT_LIST_HEAD(&wheel->l0[i]);
+    for (i = 0; i < TCPHA_WHEEL_L1_SIZE; i++)
+        INIT_LIST_HEAD(&wheel->l1[i]);
+    wheel->stat_expired = 0;
+    wheel->stat_rearmed = 0;
+}
+
+/* Everyone must have disarmed by now */
+void tcpha_fe_wheel_destroy(struct tcpha_fe_wheel *wheel)
+{
+    if (wheel->count)
+        printk(KERN_ALERT "Timer wheel destroyed with %d timers armed\n", wheel->count);
+}
+
+/* External (public) methods */
+/*---------------------------------------------------------------------------*/
+int tcpha_fe_timer_add(struct tcpha_fe_wheel *wheel, struct tcpha_fe_timer *timer, unsigned long deadline)
+{
+    int was_empty, wake;
+
+    spin_lock(&wheel->lock);
+    if (!list_empty(&timer->list)) {
+        list_del(&timer->list);
+        wheel->count--;
+    }
+    /* Nothing to catch up on, so don't */
+    was_empty = !wheel->count;
+    if (was_empty) {
+        wheel->now = tcpha_fe_wheel_clock(wheel);
+        wheel->due = tcpha_fe_wheel_jiffies(wheel, wheel->now);
+    }
+    timer->expires = tcpha_fe_wheel_ticks(wheel, deadline);
+    __tcpha_fe_timer_add(wheel, timer);
+    /* Sooner than the owner is sleeping to, it has to look again. Only
+     * tell it once, it won't sleep past this tick now. */
+    wake = was_empty || time_before(timer->expires, wheel->next);
+    if (wake)
+        wheel->next = timer->expires;
+    spin_unlock(&wheel->lock);
+
+    return wake;
+}
+
+void tcpha_fe_timer_del(struct tcpha_fe_wheel *wheel, struct tcpha_fe_timer *timer)
+{
+    spin_lock(&wheel->lock);
+    if (!list_empty(&timer->list)) {
+        list_del_init(&timer->list);
+        wheel->count--;
+    }
+    spin_unlock(&wheel->lock);
+}
+
+int tcpha_fe_wheel_expire(struct tcpha_fe_wheel *wheel, tcpha_fe_timer_fn fn, void *data, int max)
+{
+    unsigned long cur;
+    unsigned long deadline;
+    struct tcpha_fe_timer *timer;
+    struct list_head *slot;
+    int seen = 0, expired = 0;
+    int idx;
+
+    spin_lock(&wheel->lock);
+    cur = tcpha_fe_wheel_clock(wheel);
+    while (seen < max && wheel->count && time_after_eq(cur, wheel->now)) {
+        idx = wheel->now & TCPHA_WHEEL_L0_MASK;
+        /* Starting a new lap, bring the next lap of timers down */
+        if (!idx)
+            tcpha_fe_wheel_cascade(wheel,
+                &wheel->l1[(wheel->now >> TCPHA_WHEEL_L0_BITS) & TCPHA_WHEEL_L1_MASK]);
+
+        slot = &wheel->l0[idx];
+        while (seen < max && !list_empty(slot)) {
+            timer = list_entry(slot->next, struct tcpha_fe_timer, list);
+            list_del_init(&timer->list);
+            wheel->count--;
+            seen++;
+
+            deadline = fn(timer, data);
+            if (deadline) {
+                /* Still has time left, go round again */
+                timer->expires = tcpha_fe_wheel_ticks(wheel, deadline);
+                if (time_before_eq(timer->expires, wheel->now))
+                    timer->expires = wheel->now + 1;
+                __tcpha_fe_timer_add(wheel, timer);
+                wheel->stat_rearmed++;
+            } else {
+                wheel->stat_expired++;
+                expired++;
+            }
+        }
+        /* Out of budget part way through a slot, finish it next time */
+        if (!list_empty(slot))
+            break;
+        wheel->now++;
+    }
+    if (!wheel->count)
+        wheel->now = cur;
+    wheel->due = tcpha_fe_wheel_jiffies(wheel, wheel->now);
+    spin_unlock(&wheel->lock);
+
+    return expired;
+}
+
+/*
+ * The first tick with something in it, or where the next lap has to be
+ * cascaded down, whichever is sooner. At most one lap of slots is looked
+ * at, and only the first level.
+ */
+int tcpha_fe_wheel_next(struct tcpha_fe_wheel *wheel, unsigned long *deadline)
+{
+    unsigned long tick;
+
+    spin_lock(&wheel->lock);
+    if (!wheel->count) {
+        spin_unlock(&wheel->lock);
+        return 0;
+    }
+    /* Count from a clock that is up to date, so a wheel that is behind
+     * gives a deadline that has passed rather than one miles off */
+    tcpha_fe_wheel_clock(wheel);
+    for (tick = wheel->now; ; tick++) {
+        if (!(tick & TCPHA_WHEEL_L0_MASK) ||
+            !list_empty(&wheel->l0[tick & TCPHA_WHEEL_L0_MASK]))
+            break;
+    }
+    wheel->next = tick;
+    *deadline = tcpha_fe_wheel_jiffies(wheel, tick);
+    spin_unlock(&wheel->lock);
+    return 1;
+}
+
+/* Private Other Methods */
+/*---------------------------------------------------------------------------*/
+
+/* Move the clock on to now and return it. Must hold the wheel lock */
+static unsigned long tcpha_fe_wheel_clock(struct tcpha_fe_wheel *wheel)
+{
+    unsigned long ticks = (jiffies - wheel->clock_j) / TCPHA_WHEEL_TICK;
+
+    wheel->clock += ticks;
+    wheel->clock_j += ticks * TCPHA_WHEEL_TICK;
+    return wheel->clock;
+}
+
+/* The tick a jiffies deadline falls in, the current one if it has
+ * passed. Must hold the wheel lock, with the clock moved on. */
+static unsigned long tcpha_fe_wheel_ticks(struct tcpha_fe_wheel *wheel, unsigned long deadline)
+{
+    if (time_before_eq(deadline, wheel->clock_j))
+        return wheel->clock;
+    return wheel->clock + (deadline - wheel->clock_j) / TCPHA_WHEEL_TICK;
+}
+
+/* And back, when a tick starts in jiffies. Must hold the wheel lock */
+static unsigned long tcpha_fe_wheel_jiffies(struct tcpha_fe_wheel *wheel, unsigned long tick)
+{
+    return wheel->clock_j + (long)(tick - wheel->clock) * TCPHA_WHEEL_TICK;
+}
+
+/* Must hold the wheel lock */
+static void __tcpha_fe_timer_add(struct tcpha_fe_wheel *wheel, struct tcpha_fe_timer *timer)
+{
+    unsigned long expires = timer->expires;
+    unsigned long delta = expires - wheel->now;
+    struct list_head *slot;
+
+    if ((long)delta < 0) {
+        /* Already due, it goes out with the current tick */
+        slot = &wheel->l0[wheel->now & TCPHA_WHEEL_L0_MASK];
+    } else if (delta < TCPHA_WHEEL_L0_SIZE) {
+        slot = &wheel->l0[expires & TCPHA_WHEEL_L0_MASK];
+    } else {
+        /* Too far out for the wheel, park it in the last lap and it
+         * will be placed again when it cascades */
+        if (delta >= TCPHA_WHEEL_RANGE)
+            expires = wheel->now + TCPHA_WHEEL_RANGE - 1;
+        slot = &wheel->l1[(expires >> TCPHA_WHEEL_L0_BITS) & TCPHA_WHEEL_L1_MASK];
+    }
+    list_add_tail(&timer->list, slot);
+    wheel->count++;
+}
+
+/* Must hold the wheel lock */
+static void tcpha_fe_wheel_cascade(struct tcpha_fe_wheel *wheel, struct list_head *slot)
+{
+    struct tcpha_fe_timer *timer, *next;
+    LIST_HEAD(lap);
+
+    list_splice_init(slot, &lap);
+    list_for_each_entry_safe(timer, next, &lap, list) {
+        list_del(&timer->list);
+        wheel->count--;
+        __tcpha_fe_timer_add(wheel, timer);
+    }
+}
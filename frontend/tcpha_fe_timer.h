@@ -0,0 +1,95 @@
+/**
+ * tcpha_fe_timer.h
+ *
+ * A small hierarchical timer wheel, one per herder, for aging out
+ * connections without a kernel timer apiece. Arming, re-arming and
+ * expiring are all O(1). The wheel has no kernel timer of its own, the
+ * owner sleeps until tcpha_fe_wheel_next and turns it then.
+ */
+
+#ifndef _TCPHA_FE_TIMER_H_
+#define _TCPHA_FE_TIMER_H_
+
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/jiffies.h>
+
+/* The wheel turns once every TCPHA_WHEEL_TICK jiffies (100ms) */
+#define TCPHA_WHEEL_TICK (HZ / 10)
+
+/* 256 ticks in the first level, 64 * 256 in the second (~27 minutes).
+ * Anything further out sits in the last slot and gets another lap. */
+#define TCPHA_WHEEL_L0_BITS 8
+#define TCPHA_WHEEL_L1_BITS 6
+#define TCPHA_WHEEL_L0_SIZE (1 << TCPHA_WHEEL_L0_BITS)
+#define TCPHA_WHEEL_L1_SIZE (1 << TCPHA_WHEEL_L1_BITS)
+#define TCPHA_WHEEL_L0_MASK (TCPHA_WHEEL_L0_SIZE - 1)
+#define TCPHA_WHEEL_L1_MASK (TCPHA_WHEEL_L1_SIZE - 1)
+#define TCPHA_WHEEL_RANGE (1UL << (TCPHA_WHEEL_L0_BITS + TCPHA_WHEEL_L1_BITS))
+
+/* Embedded in whatever is being timed */
+struct tcpha_fe_timer {
+	struct list_head list;	/* Our slot, empty when not armed */
+	unsigned long expires;	/* In wheel ticks (of the wheels clock) */
+};
+
+/*
+ * Called under the wheel lock for every timer that comes due. Return 0
+ * to let it go, or a jiffies deadline to re-arm it for (the owner may have
+ * pushed its deadline back since it was armed, that is cheaper than
+ * moving it in the wheel every time).
+ */
+typedef unsigned long (*tcpha_fe_timer_fn)(struct tcpha_fe_timer *timer, void *data);
+
+struct tcpha_fe_wheel {
+	spinlock_t lock;
+	unsigned long now;	/* The tick we have expired up to */
+	unsigned long next;	/* The tick the owner was last told to sleep to */
+	int count;		/* Timers armed */
+
+	/* Ticks are counted from when the wheel was made rather than taken
+	 * from jiffies, jiffies / TICK jumps back when jiffies wraps. The
+	 * clock is moved on by the jiffies since clock_j, under the lock. */
+	unsigned long clock;
+	unsigned long clock_j;	/* The jiffies tick clock started at */
+	unsigned long due;	/* The jiffies tick now starts at */
+
+	struct list_head l0[TCPHA_WHEEL_L0_SIZE];
+	struct list_head l1[TCPHA_WHEEL_L1_SIZE];
+
+	/* Stats, changed under the lock */
+	unsigned long stat_expired;
+	unsigned long stat_rearmed;
+};
+
+static inline void tcpha_fe_timer_init(struct tcpha_fe_timer *timer)
+{
+	INIT_LIST_HEAD(&timer->list);
+	timer->expires = 0;
+}
+
+/* Wheel setup and teardown */
+extern void tcpha_fe_wheel_init(struct tcpha_fe_wheel *wheel);
+extern void tcpha_fe_wheel_destroy(struct tcpha_fe_wheel *wheel);
+
+/* Arm (or move) a timer for a jiffies deadline, and disarm it. Adding
+ * returns non zero if it comes due before the owner was going to wake
+ * (or nothing else was armed), the owner needs telling. */
+extern int tcpha_fe_timer_add(struct tcpha_fe_wheel *wheel, struct tcpha_fe_timer *timer, unsigned long deadline);
+extern void tcpha_fe_timer_del(struct tcpha_fe_wheel *wheel, struct tcpha_fe_timer *timer);
+
+/* Turn the wheel up to now, handing at most max due timers to fn.
+ * Returns how many fn let go. Never sleeps. */
+extern int tcpha_fe_wheel_expire(struct tcpha_fe_wheel *wheel, tcpha_fe_timer_fn fn, void *data, int max);
+
+/* Sets deadline to the jiffies the owner next needs to turn the wheel
+ * at, returns 0 (leaving it alone) if nothing is armed */
+extern int tcpha_fe_wheel_next(struct tcpha_fe_wheel *wheel, unsigned long *deadline);
+
+/* Is the wheel behind the clock */
+static inline int tcpha_fe_wheel_due(struct tcpha_fe_wheel *wheel)
+{
+	return wheel->count && time_after_eq(jiffies, wheel->due);
+}
+
+#endif